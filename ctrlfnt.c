@@ -326,57 +326,85 @@ utf8toxchar2b(XChar2b *glyphs, int maxglyphs, const char *text, int nbytes)
 	return nglyphs;
 }
 
+/*
+ * Convert text into a list of glyphs, each with the font it is rendered
+ * with and its position relative to rect.  Glyph advances are read from
+ * Xft's glyph cache, so runs of different fonts can be laid out without
+ * querying the extents of each run separately.  Return the text width.
+ */
 static int
-drawxftstring(CtrlFontSet *fontset, Picture picture, Picture src,
-             XRectangle rect, const char *text, int nbytes)
+layoutxftstring(CtrlFontSet *fontset, XftGlyphFontSpec *specs, size_t *nspecs,
+                XRectangle rect, const char *text, int nbytes)
 {
-	FT_UInt glyphs[MAXGLYPHS];
+	FcChar32 ucs[MAXGLYPHS];
 	XftFont *font;
 	XGlyphInfo extents;
 	const char *end = text;
 	size_t nglyphs = 0;
 	size_t nwritten = 0;
-	size_t n = 0;
+	size_t n, i;
 	int x = rect.x;
-	int w = 0;
+	int y;
 
-	if (nbytes == 0)
-		return 0;
-	while (end < text + nbytes && end < text + MAXGLYPHS)
-		glyphs[nglyphs++] = getnextutf8char(end, &end);
+	*nspecs = 0;
+	while (end < text + nbytes && nglyphs < MAXGLYPHS)
+		ucs[nglyphs++] = getnextutf8char(end, &end);
 	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
+		font = getfontforglyph(fontset, ucs[nwritten]);
 		n = 1 + getfontcoverage(
 			fontset,
 			font,
-			glyphs + nwritten + 1,
+			ucs + nwritten + 1,
 			nglyphs - nwritten - 1
 		);
-		XftTextRender32(
-			fontset->display,
-			PictOpOver,
-			src,
-			font,
-			picture,
-			0, 0,
-			x + w,
-			rect.y + rect.height / 2
-			       + font->ascent / 2
-			       - font->descent / 2,
-
-			glyphs + nwritten,
-			n
-		);
-		XftTextExtents32(
-			fontset->display,
-			font,
-			glyphs + nwritten,
-			n,
-			&extents
-		);
-		w += extents.width;
+		y = rect.y + rect.height / 2
+		           + font->ascent / 2
+		           - font->descent / 2;
+		for (i = nwritten; i < nwritten + n; i++) {
+			specs[i].font = font;
+			specs[i].glyph = XftCharIndex(fontset->display, font, ucs[i]);
+			specs[i].x = x;
+			specs[i].y = y;
+			XftGlyphExtents(
+				fontset->display,
+				font,
+				&specs[i].glyph,
+				1,
+				&extents
+			);
+			x += extents.xOff;
+		}
 		nwritten += n;
 	}
+	*nspecs = nglyphs;
+	return x - rect.x;
+}
+
+static int
+drawxftstring(CtrlFontSet *fontset, Picture picture, Picture src,
+             XRectangle rect, const char *text, int nbytes)
+{
+	XftGlyphFontSpec specs[MAXGLYPHS];
+	size_t nspecs;
+	int w;
+
+	if (nbytes == 0)
+		return 0;
+	w = layoutxftstring(fontset, specs, &nspecs, rect, text, nbytes);
+
+	/*
+	 * Xft packs the glyphs into a single CompositeText request,
+	 * with one glyph element for each change of font.
+	 */
+	XftGlyphFontSpecRender(
+		fontset->display,
+		PictOpOver,
+		src,
+		picture,
+		0, 0,
+		specs,
+		nspecs
+	);
 	return w;
 }
 
@@ -498,38 +526,19 @@ error:
 static int
 widthxftstring(CtrlFontSet *fontset, const char *text, int nbytes)
 {
-	FT_UInt glyphs[MAXGLYPHS];
-	XftFont *font;
-	XGlyphInfo extents;
-	const char *end = text;
-	size_t nglyphs = 0;
-	size_t nwritten = 0;
-	size_t n = 0;
-	int width = 0;
+	XftGlyphFontSpec specs[MAXGLYPHS];
+	size_t nspecs;
 
 	if (nbytes == 0)
 		return 0;
-	while (end < text + nbytes)
-		glyphs[nglyphs++] = getnextutf8char(end, &end);
-	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
-		n = 1 + getfontcoverage(
-			fontset,
-			font,
-			glyphs + nwritten + 1,
-			nglyphs - nwritten - 1
-		);
-		XftTextExtents32(
-			fontset->display,
-			font,
-			glyphs + nwritten,
-			n,
-			&extents
-		);
-		nwritten += n;
-		width += extents.xOff;
-	}
-	return width;
+	return layoutxftstring(
+		fontset,
+		specs,
+		&nspecs,
+		(XRectangle){ 0 },
+		text,
+		nbytes
+	);
 }
 
 static int
@@ -691,12 +700,6 @@ ctrlfnt_free(CtrlFontSet *fontset)
 	free(fontset);
 }
 
-void
-ctrlfnt_init(void)
-{
-	(void)FcInit();
-}
-
 void
 ctrlfnt_term(void)
 {
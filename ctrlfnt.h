@@ -23,5 +23,4 @@ ctrlfnt_draw(
 int ctrlfnt_width(CtrlFontSet *fontset, const char *text, int nbytes);
 int ctrlfnt_height(CtrlFontSet *fontset);
 void ctrlfnt_free(CtrlFontSet *fontset);
-void ctrlfnt_init(void);
 void ctrlfnt_term(void);
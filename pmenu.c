@@ -1,14 +1,30 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -19,7 +35,11 @@
 #include <X11/XKBlib.h>
 #include <X11/Xft/Xft.h>
 #include <X11/extensions/shape.h>
-#include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xinerama.h>
 #include <Imlib2.h>
 
 #include "ctrlfnt.h"
@@ -30,7 +50,27 @@
 #define TTPAD    4              /* padding for the tooltip */
 #define TTVERT   30             /* vertical distance from mouse to place tooltip */
 #define MAXPATHS 128            /* maximal number of paths to look for icons */
+#define GENLABEL "..."          /* label of a menu whose generator is running */
+#define GENCACHE "CACHE:"       /* prefix of generator line setting cache lifetime */
+#define MAXGENS  4              /* maximal number of generators running at once */
+#define MAXPREFS 16             /* maximal number of prefetched menus waiting to be opened */
+#define MAXTYPED 64             /* maximal length of the label prefix typed to select a slice */
+#define NRESULTS 8              /* number of search results shown at once */
+#define TTDELAY  1000           /* time in ms the pointer rests on a slice before its tooltip pops up */
+#define PFDELAY  150            /* time in ms the pointer rests on a slice before its menu is prefetched */
+#define MARKTIME 300            /* time in ms the pointer rests during a gesture before menus are shown */
+#define STATTIME 1000           /* time in ms between checks for changes of the menu file, without inotify */
+#define SPECTIME 1000           /* time in ms the daemon waits for a client to send its menu */
+#define MAXSPECS 8              /* maximal number of client menus kept set up by the daemon */
+#define MAXZOMBS 16             /* maximal number of stopped commands waiting to be reaped */
+#define REAPTIME 100            /* time in ms between attempts to reap stopped commands */
+#define KILLTIME 1000           /* time in ms a terminated command has to exit before it is killed */
 #define ICONPATH "ICONPATH"     /* environment variable name */
+#define STATSENV "PMENU_STATS"  /* environment variable name */
+#define PROFENV  "PMENU_PROFILE" /* environment variable name */
+#ifndef RGBFILE
+#define RGBFILE  "/usr/share/X11/rgb.txt" /* database of color names */
+#endif
 #define MAX(x,y)            ((x)>(y)?(x):(y))
 #define MIN(x,y)            ((x)<(y)?(x):(y))
 #define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
@@ -69,6 +109,9 @@
 #define DEF_COLOR_SELFG  (XRenderColor){ .red = 0xFFFF, .green = 0xFFFF, .blue = 0xFFFF, .alpha = 0xFFFF }
 #define DEF_COLOR_BORDER (XRenderColor){ .red = 0x3100, .green = 0x3100, .blue = 0x3100, .alpha = 0xFFFF }
 
+#define NBUCKETS   128      /* latency histogram buckets, four per power of two */
+#define MAXPENDING 64       /* handled events waiting for a flush to be timed */
+
 #define SEPARATOR_BEG 0.14
 #define SEPARATOR_END 0.37
 
@@ -96,6 +139,12 @@ enum {
 	TTBORDER = 1,
 };
 
+enum {
+	LATENCY_RECEIPT,        /* from event receipt to request flush */
+	LATENCY_SERVER,         /* from event server timestamp to request flush */
+	LATENCY_LAST,
+};
+
 enum Resource {
 #define X(res, s1, s2) res,
 	RESOURCES
@@ -110,46 +159,61 @@ enum Atoms {
 #undef  X
 };
 
-enum {NO_CMD = 0, CMD_NOTRUN = 1, CMD_RUN = 2};
+enum {NO_CMD = 0, CMD_NOTRUN = 1, CMD_RUN = 2, CMD_RUNNING = 3};
+
+enum {GEN_NONE, GEN_UPDATED, GEN_EMPTY};
+enum {THEME_COLOR = 1, THEME_FONT = 2, THEME_GEOMETRY = 4};
+
+#define NOSLICE (-1)
 
 struct Slice {
-	struct Slice *prev, *next;
 	struct Menu *submenu;   /* submenu spawned by clicking on slice */
-	struct Menu *parent;
 
 	char *label;            /* string to be drawed on the slice */
 	char *output;           /* string to be outputed when slice is clicked */
+	int labelw;             /* width of the label rendered in the font, measured when set up */
 	char *file;             /* filename of the icon */
-	size_t labellen;        /* strlen(label) */
-	int iscmd;              /* whether output is actually a command to popen */
-
-	unsigned slicen;
-	int x, y;               /* position of the pointer of the slice */
-	int labelx, labely;     /* position of the label */
-	int iconx, icony;       /* position of the icon */
-	double anglea, angleb;  /* angle of the borders of the slice */
+	Imlib_Image image;      /* image loaded from file, not scaled into icon yet */
+	Picture icon;           /* icon, kept on the server; or None */
+	short iconw, iconh;     /* size of the icon */
 
-	int drawn;              /* whether the pixmap have been drawn */
 	Drawable pixmap;        /* pixmap containing the pie menu with the slice selected */
 	Picture picture;        /* XRender picture */
-	Imlib_Image icon;       /* icon */
 
-	int ttdrawn;            /* whether the pixmap for the tooltip have been drawn */
-	int ttw;                /* tooltip width */
 	Window tooltip;         /* tooltip that appears when hovering a slice */
 	Drawable ttpix;         /* pixmap for the tooltip */
 	Picture ttpict;         /* pixmap for the tooltip */
+	int ttw;                /* tooltip width */
+
+	unsigned char iscmd;    /* whether output is actually a command to popen */
+	unsigned char drawn;    /* whether the pixmap have been drawn */
+	unsigned char ttdrawn;  /* whether the pixmap for the tooltip have been drawn */
 };
 
 struct Menu {
 	struct Menu *parent;    /* parent menu */
-	struct Slice *caller;   /* slice that spawned the menu */
-	struct Slice *list;     /* list of slices contained by the pie menu */
-	struct Slice *selected; /* slice currently selected in the menu */
+	struct Slice *slices;   /* array of slices contained by the pie menu */
 	unsigned nslices;       /* number of slices */
+	unsigned maxslices;     /* size of the slices array */
+	int caller;             /* number of the parent's slice that spawned the menu */
+	int selected;           /* number of the slice currently selected in the menu */
+	unsigned short *hitmap; /* map from pixels to slices (see gethitmap) */
+	struct Label *labels;   /* labels sorted for type-ahead, or NULL if not built yet */
+	unsigned nlabels;       /* number of sorted labels */
+
+	/* geometry of the slices, as arrays indexed by slice number */
+	struct {
+		short *x, *y;           /* position of the pointer of the slice */
+		short *labelx, *labely; /* position of the label */
+		short *iconx, *icony;   /* position of the icon */
+	} geom;
+
 	int x, y;               /* menu position */
 	double half;            /* angle of half a slice of the pie menu */
 	int level;              /* menu level relative to root */
+	int cached;             /* whether the menu is owned by the generator cache */
+	unsigned prefetchn;     /* next slice to be prefetched when the menu maps */
+	int complete;           /* whether the menu and all its submenus are set up */
 
 	int drawn;              /* whether the pixmap have been drawn */
 	Drawable pixmap;        /* pixmap to draw the menu on */
@@ -157,12 +221,54 @@ struct Menu {
 	Window win;             /* menu window to map on the screen */
 };
 
+/* label of a slice, in the type-ahead index of its menu */
+struct Label {
+	const char *label;
+	int slicen;
+};
+
+/* leaf of the menu tree, in the search index */
+struct Leaf {
+	struct Menu *menu;      /* menu containing the leaf */
+	int slicen;             /* number of the leaf's slice */
+	char *path;             /* labels from the root menu to the leaf, separated by "/" */
+};
+
+/* leaf matching the search query */
+struct Match {
+	int leafn;              /* number of the leaf in the search index */
+	int score;              /* how well the leaf matches, higher is better */
+};
+
+/* state of the parser building a menu tree */
+struct Parser {
+	struct Menu *rootmenu;  /* menu the tree begins at */
+	struct Menu *prevmenu;  /* menu the previous slice was added to */
+	int initlevel;          /* level of the items not indented */
+};
+
+struct HitMap {
+	struct HitMap *next;
+	unsigned nslices;
+	unsigned short *map;    /* slice number + 1 of each pixel; 0 for the centre */
+};
+
+/* shapes of a pie, drawn on the server once and composited through when drawing menus */
+struct Masks {
+	struct Masks *next;
+	unsigned nslices;
+	Picture separators;     /* separators between every slice */
+	Picture *wedges;        /* wedge of each slice, shown when it is selected; or None if not drawn yet */
+	Picture *triangles;     /* triangle of each slice opening a submenu; or None if not drawn yet */
+};
+
 struct Pie {
 	Display *display;
+	xcb_connection_t *conn; /* XCB connection under the display, for requests with replies */
 	Visual *visual;
 	Window rootwin;
 	Colormap colormap;
-	XRenderPictFormat *xformat, *alphaformat;
+	XRenderPictFormat *xformat, *alphaformat, *argbformat;
 	int screen;
 	int depth;
 	Atom atoms[NATOMS];
@@ -174,12 +280,18 @@ struct Pie {
 		Picture pict;
 	} colors[SCHEME_LAST][COLOR_LAST];
 	CtrlFontSet *fontset;
+	char *facename;         /* font name the fontset was opened with, or NULL for the default */
+	double facesize;
 	int fonth;
 
 	Pixmap clip;
 
 	Picture gradient;
 
+	struct HitMap *hitmaps; /* hit maps for each number of slices */
+	struct Masks *masks;    /* masks for each number of slices */
+	Picture disc;           /* mask of the whole pie, or None if not drawn yet */
+
 	struct {
 		XrmClass class;
 		XrmName name;
@@ -203,26 +315,211 @@ struct Pie {
 /* The pie bitmap structure */
 static struct Pie pie = { 0 };
 
+/* generators of submenus, whose output is read as it arrives */
+static struct Generator {
+	pid_t pid;              /* process group of the generator, or -1 */
+	int fd;                 /* read end of the generator's output, or -1 */
+	struct Menu *menu;      /* menu of the slice running the generator */
+	int slicen;             /* number of the slice running the generator */
+	struct Menu *submenu;   /* menu being generated, or NULL if idle */
+	struct Parser parser;   /* parser of the generator's output */
+	int nitems;             /* number of items read */
+	int ttl;                /* lifetime of the generated menu in the cache */
+	int speculative;        /* whether the menu has not been opened yet */
+	size_t len;             /* length of partial line in buf */
+	char buf[BUFSIZ];
+} generators[MAXGENS];
+static int gentimelimit = 30;           /* seconds a generator may run */
+
+/* menus whose prefetch has finished, discarded if their menu is left before they are opened */
+static struct Menu *prefetched[MAXPREFS];
+static int nprefetched = 0;
+
+/* generated menus kept for reuse, keyed by command */
+struct GenCache {
+	struct GenCache *next;
+	char *cmd;              /* command that generated the menu */
+	struct Menu *menu;      /* generated menu */
+	time_t expire;          /* time the entry expires */
+};
+static struct GenCache *gencache = NULL;
+static int genttl = 0;                  /* default lifetime of generated menus */
+static volatile sig_atomic_t flushcache = 0;
+static int themechanged = 0;            /* whether resources changed since they were loaded */
+
+/* commands of stopped generators that have not exited yet */
+static struct {
+	pid_t pid;
+	long long killtime;     /* time to kill it, in us; or 0 if it is left to exit */
+} zombies[MAXZOMBS];
+static int nzombies = 0;
+
+/* timers fired by the event loop */
+enum Timer {
+	TIMER_TOOLTIP,          /* pop up tooltip of the slice the pointer rests on */
+	TIMER_PREFETCH,         /* prefetch generated menu of the slice the pointer rests on */
+	TIMER_MARK,             /* show the menus a gesture went through */
+	TIMER_CACHE,            /* drop expired menus from the generator cache */
+	TIMER_STAT,             /* check whether the menu file changed */
+	TIMER_REAP,             /* reap stopped commands, killing those that do not exit */
+	TIMER_GENERATOR,        /* terminate a generator; one timer for each generator */
+	TIMER_LAST = TIMER_GENERATOR + MAXGENS
+};
+static struct {
+	long long when[TIMER_LAST];     /* time each timer fires */
+	int pos[TIMER_LAST];            /* position + 1 of each timer in heap, or 0 if stopped */
+	int heap[TIMER_LAST];           /* running timers, as a min-heap on when they fire */
+	int n;                          /* number of running timers */
+} timers = { 0 };
+
+/* slice whose tooltip is mapped */
+static struct {
+	struct Menu *menu;      /* menu of the slice, or NULL if no tooltip is mapped */
+	int slicen;
+	XPoint pos;             /* position of the pointer when resting on the slice */
+} tooltip = { 0 };
+
+/* search over the leaves of the menu tree */
+static struct {
+	struct Leaf *leaves;    /* index of every leaf */
+	int nleaves, maxleaves;
+	struct Match *matches;  /* leaves matching the query, best first */
+	int nmatches;
+	char query[MAXTYPED];   /* query typed so far; not nul-terminated */
+	size_t nquery;
+	int page;               /* page of matches shown */
+	struct Menu *menu;      /* menu showing the matches, or NULL if not searching */
+	struct Menu *root;      /* menu tree indexed, or NULL if there is no index */
+} search = { 0 };
+
+/* monitor layout, queried when first needed and again only when the screen changes */
+static struct {
+	XRectangle *rects;
+	int n;                  /* number of monitors, or 0 if not queried yet */
+	int last;               /* monitor the pointer was last found on */
+	int width, height;      /* size of the screen, or 0 if not known yet */
+	int rrevent;            /* base of RandR event codes, or -1 if RandR is missing */
+} monitors = { .rrevent = -1 };
+
+/* requests sent through XCB whose replies are collected when needed */
+static struct {
+	xcb_query_pointer_cookie_t pointer;
+	xcb_xinerama_query_screens_cookie_t screens;
+	int haspointer;         /* whether the reply to the pointer query is pending */
+	int hasscreens;         /* whether the reply to the screens query is pending */
+} cookies = { 0 };
+
+/* database of color names, read at most once each time the resources are loaded */
+static struct {
+	char *data;             /* contents of RGBFILE, or NULL if it could not be read */
+	int read;               /* whether RGBFILE has been read */
+} rgbnames = { 0 };
+
+/* menus sent by clients of the daemon, most recently used first */
+static struct {
+	char *spec;             /* items, as sent by the client */
+	struct Menu *menu;      /* menu tree set up from the items */
+} specs[MAXSPECS];
+static int nspecs = 0;
+static int clientfd = -1;       /* connection to client whose menu is shown, or -1 */
+
 /* flags */
 static int harddiameter = 0;
 static int execcommand = 0;
 static int rootmodeflag = 0;            /* wheter to run in root mode */
 static int nowarpflag = 0;              /* whether to disable pointer warping */
 static int passclickflag = 0;           /* whether to pass click to root window */
+static int markingflag = 0;             /* whether to select by gesture before showing menus */
+static int daemonflag = 0;              /* whether to show menus sent by clients */
+static enum {
+	PREFETCH_NONE,
+	PREFETCH_HOVER,                 /* prefetch generated menu of hovered slice */
+	PREFETCH_MAP,                   /* and of every slice of a mapped menu */
+} prefetchflag = PREFETCH_NONE;
 
 /* arguments */
 static unsigned int button = 0;         /* button to trigger pmenu in root mode */
 static unsigned int modifier = 0;       /* modifier to trigger pmenu */
+static unsigned int numlockmask = 0;    /* modifier of the num lock key */
+static int xerrorcode = Success;        /* code of the last error caught by xerrorsave */
+
+/* menu file */
+static char *menufile = NULL;           /* file to read the menu from, or NULL for stdin */
+static struct stat menustat;            /* state of the menu file when last read */
+static char *stdinspec = NULL;          /* standard input, if read for a daemon that was not there */
+static size_t stdinlen = 0;             /* length of stdinspec */
 
 /* icons paths */
 static char *iconstring = NULL;         /* string read from getenv */
 static char *iconpaths[MAXPATHS];       /* paths to icon directories */
 static int niconpaths = 0;              /* number of paths to icon directories */
 
+/* interaction counters, reported on exit when STATSENV is set */
+static int statsflag = 0;
+static struct {
+	unsigned long nevents;          /* events received */
+	unsigned long nmotions;         /* motion events received */
+	unsigned long ncoalesced;       /* motion events superseded by a later one */
+	unsigned long nunchanged;       /* motion events that did not change selection */
+	unsigned long nrepaints;        /* menu windows repainted */
+	unsigned long ndraws;           /* menu pixmaps drawn */
+	unsigned long nflushes;         /* output buffer flushes */
+	unsigned long nroundtrips;      /* requests waited a reply from the server for */
+	unsigned long ninteractions;    /* flushes of requests caused by events */
+	unsigned long long nbytes;      /* bytes sent to the server in those flushes */
+	unsigned long long maxbytes;    /* most bytes sent in one of them */
+	unsigned long long written;     /* bytes sent to the server until the last flush */
+} stats;
+
+/* startup phases, timed and reported on exit when PROFENV is set */
+enum Phase {
+	PHASE_OTHER,            /* anything not in the phases below */
+	PHASE_XCONN,            /* the steps of initsteps[] in main, in order */
+	PHASE_VISUAL,
+	PHASE_RESOURCES,
+	PHASE_THEME,
+	PHASE_PIE,
+	PHASE_IMLIB,            /* setting up Imlib2, when the first icon is set up */
+	PHASE_PARSE,            /* waiting for the items to be parsed, after setting up X */
+	PHASE_TEXT,             /* measuring labels, in setmenu */
+	PHASE_ICONS,            /* loading icons, in setmenu */
+	PHASE_XRES,             /* the rest of setmenu, mostly creating X resources */
+	PHASE_IDLE,             /* waiting to be triggered, in root or daemon mode */
+	PHASE_MAP,              /* grabbing input, placing and mapping the first menu */
+	PHASE_WAIT,             /* waiting for the first event after mapping */
+	PHASE_DRAW,             /* drawing the first menu, until the server has drawn it */
+	PHASE_LAST
+};
+static int profileflag = 0;
+static struct {
+	int running;                    /* whether startup is still being timed */
+	enum Phase phase;               /* phase being timed */
+	long long begin;                /* time the phase was entered, in us */
+	unsigned long lastseq;          /* last request known to be processed by the server */
+	long long us[PHASE_LAST];       /* time spent in each phase */
+	unsigned long nroundtrips[PHASE_LAST];
+} profile;
+
+/* latency histograms of handled events, reported along with stats */
+static volatile sig_atomic_t dumpstats = 0;
+static struct {
+	int syncflag;                   /* whether to wait for the server to process requests */
+	int32_t mindelay;               /* minimal delay from server timestamp to receipt, in ms */
+	int hasdelay;                   /* whether mindelay has been set */
+	int npending;
+	struct {
+		int type;
+		int hastime;            /* whether the event has a server timestamp */
+		int32_t delay;          /* delay from server timestamp to receipt, in ms */
+		long long receipt;      /* time of receipt, in us */
+	} pending[MAXPENDING];
+	unsigned long hist[LASTEvent][LATENCY_LAST][NBUCKETS];
+} latency;
+
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: pmenu [-ew] [-d diameter] [-N name] [(-x|-X) [modifier-]button]\n");
+	(void)fprintf(stderr, "usage: pmenu [-DegSsw] [-c ttl] [-d diameter] [-f file] [-N name] [-t timeout] [(-x|-X) [modifier-]button]\n");
 	exit(1);
 }
 
@@ -356,8 +653,20 @@ getoptions(int argc, char **argv)
 	if (pie.classh.res_name == NULL)
 		pie.classh.res_name = NAME;
 	parseiconpaths(getenv(ICONPATH));
-	while ((ch = getopt(argc, argv, "d:eN:wx:X:P:r:m:p")) != -1) {
+	if ((s = getenv(STATSENV)) != NULL) {
+		statsflag = 1;
+		latency.syncflag = strcmp(s, "sync") == 0;
+	}
+	while ((ch = getopt(argc, argv, "c:Dd:ef:gN:St:swx:X:P:r:m:p")) != -1) {
 		switch (ch) {
+		case 'c':
+			l = strtol(optarg, &endp, 10);
+			if (optarg[0] != '\0' && *endp == '\0' && l >= 0 && l <= INT_MAX)
+				genttl = l;
+			break;
+		case 'D':
+			daemonflag = 1;
+			break;
 		case 'd':
 			l = strtol(optarg, &endp, 10);
 			if (optarg[0] != '\0' && *endp == '\0' && l > 0 && l <= 100) {
@@ -368,9 +677,27 @@ getoptions(int argc, char **argv)
 		case 'e':
 			execcommand = !execcommand;
 			break;
+		case 'f':
+			menufile = optarg;
+			break;
+		case 'g':
+			markingflag = 1;
+			break;
 		case 'N':
 			pie.classh.res_name = optarg;
 			break;
+		case 'S':
+			prefetchflag = PREFETCH_MAP;
+			break;
+		case 't':
+			l = strtol(optarg, &endp, 10);
+			if (optarg[0] != '\0' && *endp == '\0' && l >= 0 && l <= INT_MAX / 1000)
+				gentimelimit = l;
+			break;
+		case 's':
+			if (prefetchflag == PREFETCH_NONE)
+				prefetchflag = PREFETCH_HOVER;
+			break;
 		case 'w':
 			nowarpflag = 1;
 			break;
@@ -422,48 +749,179 @@ emalloc(size_t size)
 	return p;
 }
 
-/* allocate an slice */
-static struct Slice *
-allocslice(const char *label, const char *output, char *file)
+/* call realloc checking for error */
+static void *
+erealloc(void *ptr, size_t size)
+{
+	void *p;
+
+	if ((p = realloc(ptr, size)) == NULL)
+		err(1, "realloc");
+	return p;
+}
+
+/* get monotonic time in microseconds */
+static long long
+getmicro(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* charge time since the phase was entered to it, and enter another phase; return the phase left */
+static enum Phase
+setphase(enum Phase phase)
+{
+	enum Phase prev = profile.phase;
+	long long now;
+
+	if (!profile.running)
+		return prev;
+	now = getmicro();
+	profile.us[prev] += now - profile.begin;
+	profile.begin = now;
+	profile.phase = phase;
+	return prev;
+}
+
+/* count a round trip in the current phase */
+static void
+countwait(void)
+{
+	profile.nroundtrips[profile.phase]++;
+	stats.nroundtrips++;
+}
+
+/* count a round trip if the last request got a reply; called by Xlib after each request */
+static int
+countroundtrip(Display *dpy)
+{
+	unsigned long seq;
+
+	seq = XLastKnownRequestProcessed(dpy);
+	if (seq != profile.lastseq && seq + 1 == XNextRequest(dpy))
+		countwait();
+	profile.lastseq = seq;
+	return 0;
+}
+
+/* get reply to XCB request seq, or NULL on error; waiting for it counts as a round trip */
+static void *
+getreply(unsigned int seq)
+{
+	xcb_generic_error_t *error = NULL;
+	void *reply = NULL;
+
+	if (!xcb_poll_for_reply(pie.conn, seq, &reply, &error)) {
+		countwait();
+		reply = xcb_wait_for_reply(pie.conn, seq, &error);
+	}
+	free(error);
+	return reply;
+}
+
+/* stop timing startup */
+static void
+endprofile(Display *dpy)
+{
+	(void)setphase(PHASE_OTHER);
+	profile.running = 0;
+	(void)XSetAfterFunction(dpy, NULL);
+}
+
+/* append an slice to the menu; return its number */
+static int
+addslice(struct Menu *menu, const char *label, const char *output, char *file)
 {
 	struct Slice *slice;
 
-	slice = emalloc(sizeof *slice);
+	if (menu->nslices == menu->maxslices) {
+		menu->maxslices = (menu->maxslices == 0) ? 8 : menu->maxslices * 2;
+		menu->slices = erealloc(
+			menu->slices,
+			menu->maxslices * sizeof(*menu->slices)
+		);
+	}
+	free(menu->labels);
+	menu->labels = NULL;
+	slice = &menu->slices[menu->nslices];
 	slice->label = (label != NULL) ? estrdup(label) : NULL;
 	slice->file = (file != NULL) ? estrdup(file) : NULL;
-	slice->labellen = (slice->label != NULL) ? strlen(slice->label) : 0;
-	slice->y = 0;
-	slice->next = NULL;
 	slice->submenu = NULL;
-	slice->icon = NULL;
+	slice->image = NULL;
+	slice->icon = None;
+	slice->pixmap = None;
+	slice->picture = None;
+	slice->tooltip = None;
+	slice->ttpix = None;
+	slice->ttpict = None;
+	slice->ttw = 0;
+	slice->labelw = 0;
 	if (output && *output == '$') {
 		output++;
 		while (isspace(*output))
 			output++;
 		slice->output = estrdup(output);
 		slice->iscmd = CMD_NOTRUN;
+	} else if (output == NULL) {    /* placeholder slice, selecting it does nothing */
+		slice->output = NULL;
+		slice->iscmd = NO_CMD;
 	} else {
 		slice->output = (label == output) ? slice->label : estrdup(output);
 		slice->iscmd = NO_CMD;
 	}
-	return slice;
+	return menu->nslices++;
 }
 
-/* allocate a menu */
+/* allocate a menu; its window is created when the menu is set up */
 static struct Menu *
-allocmenu(struct Menu *parent, struct Slice *list, int level)
+allocmenu(struct Menu *parent, int level)
 {
-	XSizeHints sizeh;
 	struct Menu *menu;
 
 	menu = emalloc(sizeof *menu);
 
+	/* set menu variables */
+	menu->parent = parent;
+	menu->slices = NULL;
+	menu->nslices = 0;
+	menu->maxslices = 0;
+	menu->caller = NOSLICE;
+	menu->selected = NOSLICE;
+	menu->hitmap = NULL;
+	menu->geom.x = NULL;
+	menu->x = 0;
+	menu->y = 0;
+	menu->level = level;
+	menu->cached = 0;
+	menu->prefetchn = 0;
+	menu->complete = 0;
+	menu->labels = NULL;
+	menu->nlabels = 0;
+	menu->win = None;
+	menu->pixmap = None;
+	menu->picture = None;
+	menu->drawn = 0;
+
+	return menu;
+}
+
+/* create menu window and the pixmap it is drawn on */
+static void
+createmenu(struct Menu *menu)
+{
+	XSizeHints sizeh;
+
 	/* create menu window */
 	menu->win = createwindow(
 		pie.fulldiameter, pie.fulldiameter,
 		KeyPressMask | ButtonPressMask |
 		ButtonReleaseMask | PointerMotionMask | LeaveWindowMask
 	);
+	menu->x = 0;
+	menu->y = 0;
 
 	/* Set window type */
 	XChangeProperty(pie.display, menu->win, pie.atoms[NET_WM_WINDOW_TYPE], XA_ATOM, 32,
@@ -478,16 +936,6 @@ allocmenu(struct Menu *parent, struct Slice *list, int level)
 	sizeh.min_height = sizeh.max_height = pie.fulldiameter;
 	XSetWMProperties(pie.display, menu->win, NULL, NULL, NULL, 0, &sizeh, NULL, &pie.classh);
 
-	/* set menu variables */
-	menu->parent = parent;
-	menu->list = list;
-	menu->caller = NULL;
-	menu->selected = NULL;
-	menu->nslices = 0;
-	menu->x = 0;
-	menu->y = 0;
-	menu->level = level;
-
 	/* create pixmap and picture */
 	menu->pixmap = XCreatePixmap(
 		pie.display,
@@ -503,115 +951,119 @@ allocmenu(struct Menu *parent, struct Slice *list, int level)
 		0,
 		NULL
 	);
-	menu->drawn = 0;
-
-	return menu;
 }
 
 /* build the menu tree */
-static struct Menu *
-buildmenutree(struct Menu *rootmenu, int level, const char *label, const char *output, char *file)
+static int
+buildmenutree(struct Parser *parser, int level, const char *label, const char *output, char *file)
 {
-	static struct Menu *prevmenu;           /* menu the previous slice was added to */
-	struct Slice *currslice = NULL;         /* slice currently being read */
-	struct Slice *slice;                    /* dummy slice for loops */
 	struct Menu *menu;                      /* dummy menu for loops */
+	struct Slice *slice;
 	int i;
 
-	if (rootmenu == NULL)
-		prevmenu = NULL;
-
-	/* create the slice */
-	currslice = allocslice(label, output, file);
-
 	/* put the slice in the menu tree */
-	if (prevmenu == NULL) {                 /* there is no menu yet */
-		menu = allocmenu(NULL, currslice, level);
-		rootmenu = menu;
-		prevmenu = menu;
-		currslice->prev = NULL;
-	} else if (level < prevmenu->level) {   /* slice is continuation of a parent menu */
+	if (parser->prevmenu == NULL) {         /* there is no menu yet */
+		menu = allocmenu(NULL, level);
+		parser->rootmenu = menu;
+		parser->prevmenu = menu;
+	} else if (level < parser->prevmenu->level) {   /* slice is continuation of a parent menu */
 		/* go up the menu tree until find the menu this slice continues */
-		for (menu = prevmenu, i = level;
-			  menu != NULL && i != prevmenu->level;
+		for (menu = parser->prevmenu, i = level;
+			  menu != NULL && i != parser->prevmenu->level;
 			  menu = menu->parent, i++)
 			;
-		if (menu == NULL)
-			errx(1, "improper indentation detected");
-
-		/* find last slice in the new menu */
-		for (slice = menu->list; slice->next != NULL; slice = slice->next)
-			;
-
-		prevmenu = menu;
-		slice->next = currslice;
-		currslice->prev = slice;
-	} else if (level == prevmenu->level) {  /* slice is a continuation of current menu */
-		/* find last slice in the previous menu */
-		for (slice = prevmenu->list; slice->next != NULL; slice = slice->next)
-			;
+		if (menu == NULL) {
+			warnx("improper indentation detected");
+			return RETURN_FAILURE;
+		}
 
-		slice->next = currslice;
-		currslice->prev = slice;
-	} else if (level > prevmenu->level) {   /* slice begins a new menu */
-		menu = allocmenu(prevmenu, currslice, level);
+		parser->prevmenu = menu;
+	} else if (level > parser->prevmenu->level) {   /* slice begins a new menu */
+		/* a generated menu begins empty, with no slice to spawn the new menu */
+		if (parser->prevmenu->nslices == 0) {
+			warnx("improper indentation detected");
+			return RETURN_FAILURE;
+		}
 
-		/* find last slice in the previous menu */
-		for (slice = prevmenu->list; slice->next != NULL; slice = slice->next)
-			;
+		/* while a generator is running, a slice of its menu may have run its own */
+		slice = &parser->prevmenu->slices[parser->prevmenu->nslices - 1];
+		if (slice->submenu != NULL || slice->iscmd == CMD_RUNNING || slice->iscmd == CMD_RUN) {
+			warnx("items under a command that has already run");
+			return RETURN_FAILURE;
+		}
+		menu = allocmenu(parser->prevmenu, level);
 
-		prevmenu = menu;
-		menu->caller = slice;
-		slice->submenu = menu;
-		currslice->prev = NULL;
+		/* the new menu is spawned by the last slice in the previous menu */
+		menu->caller = parser->prevmenu->nslices - 1;
+		parser->prevmenu->slices[menu->caller].submenu = menu;
+		parser->prevmenu = menu;
 	}
 
-	prevmenu->nslices++;
-
-	return rootmenu;
+	/* create the slice */
+	(void)addslice(parser->prevmenu, label, output, file);
+	return RETURN_SUCCESS;
 }
 
-/* create menus and slices from the stdin */
-static struct Menu *
-parse(FILE *fp, int initlevel)
+/* add item described by line into the menu tree */
+static int
+parseline(struct Parser *parser, char *buf)
 {
-	struct Menu *rootmenu;
-	char *s, buf[BUFSIZ];
+	char *s, *last;
 	char *file, *label, *output;
 	int level;
 
-	rootmenu = NULL;
-	while (fgets(buf, BUFSIZ, fp) != NULL) {
-		/* get the indentation level */
-		level = strspn(buf, "\t");
+	/* get the indentation level */
+	level = strspn(buf, "\t");
 
-		/* get the label */
-		s = level + buf;
-		label = strtok(s, "\t\n");
+	/* get the label */
+	s = level + buf;
+	label = strtok_r(s, "\t\n", &last);
 
-		if (label == NULL)
-			errx(1, "empty item");
+	if (label == NULL) {
+		warnx("empty item");
+		return RETURN_FAILURE;
+	}
 
-		/* get the filename */
-		file = NULL;
-		if (label != NULL && strncmp(label, "IMG:", 4) == 0) {
-			file = label + 4;
-			label = strtok(NULL, "\t\n");
-		}
+	/* get the filename */
+	file = NULL;
+	if (label != NULL && strncmp(label, "IMG:", 4) == 0) {
+		file = label + 4;
+		label = strtok_r(NULL, "\t\n", &last);
+	}
 
-		/* get the output */
-		output = strtok(NULL, "\n");
-		if (output == NULL) {
-			output = label;
-		} else {
-			while (*output == '\t')
-				output++;
-		}
+	/* get the output */
+	output = strtok_r(NULL, "\n", &last);
+	if (output == NULL) {
+		output = label;
+	} else {
+		while (*output == '\t')
+			output++;
+	}
 
-		rootmenu = buildmenutree(rootmenu, initlevel + level, label, output, file);
+	return buildmenutree(parser, parser->initlevel + level, label, output, file);
+}
+
+static void cleanmenu(struct Menu *menu);
+
+/* create menus and slices from the stdin; return NULL on error */
+static struct Menu *
+parse(FILE *fp, int initlevel)
+{
+	struct Parser parser = {
+		.rootmenu = NULL,
+		.prevmenu = NULL,
+		.initlevel = initlevel,
+	};
+	char buf[BUFSIZ];
+
+	while (fgets(buf, BUFSIZ, fp) != NULL) {
+		if (parseline(&parser, buf) == RETURN_FAILURE) {
+			cleanmenu(parser.rootmenu);
+			return NULL;
+		}
 	}
 
-	return rootmenu;
+	return parser.rootmenu;
 }
 
 /* check if path is absolute or relative to current directory */
@@ -621,16 +1073,15 @@ isabsolute(const char *s)
 	return s[0] == '/' || (s[0] == '.' && (s[1] == '/' || (s[1] == '.' && s[2] == '/')));
 }
 
-/* load image from file and scale it to size; return the image and its size */
+/* load image from file, looking for it on the icon paths */
+/* it is not scaled, as it may be loaded before the size of the pie is known */
 static Imlib_Image
-loadicon(const char *file, int size, int *width_ret, int *height_ret)
+openicon(const char *file)
 {
 	Imlib_Image icon = NULL;
 	Imlib_Load_Error errcode;
 	char path[PATH_MAX];
 	const char *errstr;
-	int width;
-	int height;
 	int i;
 
 	if (*file == '\0') {
@@ -688,7 +1139,21 @@ loadicon(const char *file, int size, int *width_ret, int *height_ret)
 		return NULL;
 	}
 
+	/* Imlib2 reads the image data only when needed; read it now */
 	imlib_context_set_image(icon);
+	(void)imlib_image_get_data_for_reading_only();
+	return icon;
+}
+
+/* scale image to size and free it; return the icon and its size */
+static Imlib_Image
+scaleicon(Imlib_Image image, int size, int *width_ret, int *height_ret)
+{
+	Imlib_Image icon;
+	int width;
+	int height;
+
+	imlib_context_set_image(image);
 
 	width = imlib_image_get_width();
 	height = imlib_image_get_height();
@@ -703,45 +1168,142 @@ loadicon(const char *file, int size, int *width_ret, int *height_ret)
 
 	icon = imlib_create_cropped_scaled_image(0, 0, width, height,
 	                                         *width_ret, *height_ret);
+	imlib_free_image();
 
 	return icon;
 }
 
+/* upload icon to the server, to be composited from there on; the image is freed */
+static Picture
+uploadicon(Imlib_Image icon, int width, int height)
+{
+	XImage *ximage;
+	Picture picture;
+	Pixmap pixmap;
+	GC gc;
+	uint32_t *data, *pixels;
+	uint32_t a;
+	int hasalpha;
+	int i;
+
+	imlib_context_set_image(icon);
+	data = imlib_image_get_data_for_reading_only();
+	hasalpha = imlib_image_has_alpha();
+	pixels = emalloc(width * height * sizeof(*pixels));
+	for (i = 0; i < width * height; i++) {
+		/* XRender takes premultiplied alpha, Imlib2 gives it straight */
+		a = hasalpha ? data[i] >> 24 : 0xFF;
+		pixels[i] = (a << 24)
+		          | ((((data[i] >> 16) & 0xFF) * a / 0xFF) << 16)
+		          | ((((data[i] >> 8) & 0xFF) * a / 0xFF) << 8)
+		          | ((data[i] & 0xFF) * a / 0xFF);
+	}
+	imlib_free_image();
+
+	pixmap = XCreatePixmap(pie.display, pie.rootwin, width, height, 32);
+	ximage = XCreateImage(
+		pie.display,
+		pie.visual,
+		32,
+		ZPixmap,
+		0,
+		(char *)pixels,
+		width, height,
+		32, 0
+	);
+	/* the pixels are in our byte order; Xlib swaps them if the server's differs */
+	ximage->byte_order = (*(unsigned char *)&(uint32_t){ 1 }) ? LSBFirst : MSBFirst;
+	gc = XCreateGC(pie.display, pixmap, 0, NULL);
+	XPutImage(pie.display, pixmap, gc, ximage, 0, 0, 0, 0, width, height);
+	XFreeGC(pie.display, gc);
+	XDestroyImage(ximage);
+	picture = XRenderCreatePicture(pie.display, pixmap, pie.argbformat, 0, NULL);
+	XFreePixmap(pie.display, pixmap);
+	return picture;
+}
+
+/* recursivelly load the images of the icons of the menu, to be scaled when the menu is set up */
+static void
+openicons(struct Menu *menu)
+{
+	struct Slice *slice;
+	unsigned n;
+
+	for (n = 0; n < menu->nslices; n++) {
+		slice = &menu->slices[n];
+		if (slice->file != NULL && slice->image == NULL)
+			slice->image = openicon(slice->file);
+		if (slice->submenu != NULL) {
+			openicons(slice->submenu);
+		}
+	}
+}
+
+/* set Imlib2 up to scale icons; menus without icons never need it */
+static void
+initimlib(void)
+{
+	static int done = 0;
+	enum Phase phase;
+
+	if (done)
+		return;
+	done = 1;
+	phase = setphase(PHASE_IMLIB);
+	imlib_set_cache_size(2048 * 1024);
+	(void)setphase(phase);
+}
+
 /* setup position of and content of menu's slices */
-/* recursivelly setup menu configuration and its pixmap */
+/* slices already set up are just laid out again */
 static void
-setslices(struct Menu *menu)
+setmenu(struct Menu *menu)
 {
 	struct Slice *slice;
+	enum Phase phase;
 	double a = 0.0;
-	unsigned n = 0;
+	unsigned n;
+	short *geom;
 	int textwidth;
 	int w, h;
 
+	if (menu->win == None)
+		createmenu(menu);
 	menu->half = M_PI / menu->nslices;
-	for (slice = menu->list; slice; slice = slice->next) {
-		slice->parent = menu;
-		slice->slicen = n++;
+	menu->hitmap = NULL;
+	menu->drawn = 0;
 
-		slice->anglea = a - menu->half;
-		slice->angleb = a + menu->half;
+	/* allocate the geometry arrays in a single block */
+	free(menu->geom.x);
+	geom = emalloc(6 * menu->nslices * sizeof(*geom));
+	menu->geom.x = geom;
+	menu->geom.y = geom + menu->nslices;
+	menu->geom.labelx = geom + 2 * menu->nslices;
+	menu->geom.labely = geom + 3 * menu->nslices;
+	menu->geom.iconx = geom + 4 * menu->nslices;
+	menu->geom.icony = geom + 5 * menu->nslices;
+
+	for (n = 0; n < menu->nslices; n++) {
+		slice = &menu->slices[n];
 
 		/* get length of slice->label rendered in the font */
-		if (slice->label != NULL)
-			textwidth = ctrlfnt_width(pie.fontset, slice->label, strlen(slice->label));
-		else
-			textwidth = 0;
+		if (slice->pixmap == None && slice->label != NULL) {
+			phase = setphase(PHASE_TEXT);
+			slice->labelw = ctrlfnt_width(pie.fontset, slice->label, strlen(slice->label));
+			(void)setphase(phase);
+		}
+		textwidth = slice->labelw;
 
 		/* get position of slice's label */
-		slice->labelx = pie.border + pie.radius + ((pie.radius*2)/3 * cos(a)) - (textwidth / 2);
-		slice->labely = pie.border + pie.radius - ((pie.radius*2)/3 * sin(a)) - (pie.fonth / 2);
+		menu->geom.labelx[n] = pie.border + pie.radius + ((pie.radius*2)/3 * cos(a)) - (textwidth / 2);
+		menu->geom.labely[n] = pie.border + pie.radius - ((pie.radius*2)/3 * sin(a)) - (pie.fonth / 2);
 
 		/* get position of submenu */
-		slice->x = pie.radius + (pie.diameter * (cos(a) * 0.9));
-		slice->y = pie.radius - (pie.diameter * (sin(a) * 0.9));
+		menu->geom.x[n] = pie.radius + (pie.diameter * (cos(a) * 0.9));
+		menu->geom.y[n] = pie.radius - (pie.diameter * (sin(a) * 0.9));
 
-		/* create icon */
-		if (slice->file != NULL) {
+		/* create icon; its file name is kept to compare the slice when reloading */
+		if (slice->file != NULL && slice->icon == None && slice->pixmap == None) {
 			int maxiconsize = (pie.radius + 1) / 2;
 			int iconw, iconh;       /* icon width and height */
 			int iconsize;           /* requested icon size */
@@ -753,15 +1315,34 @@ setslices(struct Menu *menu)
 			iconsize = sqrt(xdiff * xdiff + ydiff * ydiff);
 			iconsize = MIN(maxiconsize, iconsize);
 
-			if ((slice->icon = loadicon(slice->file, iconsize, &iconw, &iconh)) != NULL) {
-				slice->iconx = pie.border + pie.radius + (pie.radius * (cos(a) * 0.6)) - iconw / 2;
-				slice->icony = pie.border + pie.radius - (pie.radius * (sin(a) * 0.6)) - iconh / 2;
+			initimlib();
+			phase = setphase(PHASE_ICONS);
+			if (slice->image == NULL)
+				slice->image = openicon(slice->file);
+			if (slice->image != NULL) {
+				slice->icon = uploadicon(
+					scaleicon(slice->image, iconsize, &iconw, &iconh),
+					iconw, iconh
+				);
+				slice->iconw = iconw;
+				slice->iconh = iconh;
 			}
+			slice->image = NULL;
+			(void)setphase(phase);
+		}
 
-			free(slice->file);
-			slice->file = NULL;
+		/* get position of icon */
+		if (slice->icon != None) {
+			menu->geom.iconx[n] = pie.border + pie.radius + (pie.radius * (cos(a) * 0.6)) - slice->iconw / 2;
+			menu->geom.icony[n] = pie.border + pie.radius - (pie.radius * (sin(a) * 0.6)) - slice->iconh / 2;
 		}
 
+		/* the pixmap must be redrawn, as the geometry may have changed */
+		slice->drawn = 0;
+		a += menu->half * 2;
+		if (slice->pixmap != None)
+			continue;
+
 		/* create pixmap */
 		slice->pixmap = XCreatePixmap(
 			pie.display,
@@ -777,7 +1358,6 @@ setslices(struct Menu *menu)
 			0,
 			NULL
 		);
-		slice->drawn = 0;
 
 		/* create tooltip */
 		slice->ttdrawn = 0;
@@ -815,129 +1395,264 @@ setslices(struct Menu *menu)
 			slice->ttpix = None;
 			slice->ttpict = None;
 		}
-
-		/* call recursivelly */
-		if (slice->submenu != NULL) {
-			setslices(slice->submenu);
-		}
-
-		a += menu->half * 2;
 	}
 }
 
-/* query monitor information and cursor position */
+/* recursivelly setup menu configuration and its pixmap */
 static void
-getmonitor(XRectangle *monitor, XPoint *pointer)
+setslices(struct Menu *menu)
 {
-	XineramaScreenInfo *info = NULL;
-	Window dw;          /* dummy variable */
-	int di;             /* dummy variable */
-	unsigned du;        /* dummy variable */
-	int nmons;
-	int i;
-	int x, y;
+	unsigned n;
 
-	XQueryPointer(pie.display, pie.rootwin, &dw, &dw, &x, &y, &di, &di, &du);
-	pointer->x = x;
-	pointer->y = y;
-	monitor->x = monitor->y = 0;
-	monitor->width = DisplayWidth(pie.display, pie.screen);
-	monitor->height = DisplayHeight(pie.display, pie.screen);
-	if ((info = XineramaQueryScreens(pie.display, &nmons)) != NULL) {
-		int selmon = 0;
-
-		for (i = 0; i < nmons; i++) {
-			if (BETWEEN(pointer->x, info[i].x_org, info[i].x_org + info[i].width) &&
-			    BETWEEN(pointer->y, info[i].y_org, info[i].y_org + info[i].height)) {
-				selmon = i;
-				break;
-			}
+	setmenu(menu);
+	for (n = 0; n < menu->nslices; n++) {
+		if (menu->slices[n].submenu != NULL) {
+			setslices(menu->slices[n].submenu);
 		}
+	}
+}
 
-		monitor->x = info[selmon].x_org;
-		monitor->y = info[selmon].y_org;
-		monitor->width = info[selmon].width;
-		monitor->height = info[selmon].height;
+/* set up the first menu under menu that is not set up yet; return zero if there is none */
+/* the submenus are set up one at a time in idle time, after the first menu is shown */
+static int
+setupnext(struct Menu *menu)
+{
+	unsigned n;
 
-		XFree(info);
+	if (menu == NULL || menu->complete)
+		return 0;
+	if (menu->geom.x == NULL) {
+		setmenu(menu);
+		return 1;
 	}
+	for (n = 0; n < menu->nslices; n++)
+		if (menu->slices[n].submenu != NULL && setupnext(menu->slices[n].submenu))
+			return 1;
+	menu->complete = 1;
+	return 0;
 }
 
-/* try to grab pointer, we may have to wait for another process to ungrab */
+/* ask for the monitor layout, if Xinerama is there; the reply is collected by querymonitors */
 static void
-grabpointer(void)
+askmonitors(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	const xcb_query_extension_reply_t *ext;
 
-	for (i = 0; i < 1000; i++) {
-		if (XGrabPointer(pie.display, pie.rootwin, True, ButtonPressMask,
-		                 GrabModeAsync, GrabModeAsync, None,
-		                 None, CurrentTime) == GrabSuccess)
-			return;
-		nanosleep(&ts, NULL);
-	}
-	errx(1, "could not grab pointer");
+	if (cookies.hasscreens)
+		return;
+	ext = xcb_get_extension_data(pie.conn, &xcb_xinerama_id);
+	if (ext == NULL || !ext->present)
+		return;
+	cookies.screens = xcb_xinerama_query_screens(pie.conn);
+	cookies.hasscreens = 1;
 }
 
-/* try to grab keyboard, we may have to wait for another process to ungrab */
+/* query the monitor layout, unless it is known already */
 static void
-grabkeyboard(void)
+querymonitors(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	xcb_xinerama_query_screens_reply_t *reply = NULL;
+	xcb_xinerama_screen_info_t *info;
+	int i, n = 0;
 
-	for (i = 0; i < 1000; i++) {
-		if (XGrabKeyboard(pie.display, pie.rootwin, True, GrabModeAsync,
-		                  GrabModeAsync, CurrentTime) == GrabSuccess)
-			return;
-		nanosleep(&ts, NULL);
+	if (monitors.n > 0)
+		return;
+	if (monitors.width == 0) {
+		monitors.width = DisplayWidth(pie.display, pie.screen);
+		monitors.height = DisplayHeight(pie.display, pie.screen);
 	}
-	errx(1, "could not grab keyboard");
+	monitors.last = 0;
+	askmonitors();
+	if (cookies.hasscreens) {
+		cookies.hasscreens = 0;
+		if ((reply = getreply(cookies.screens.sequence)) != NULL)
+			n = xcb_xinerama_query_screens_screen_info_length(reply);
+	}
+	if (n > 0) {
+		info = xcb_xinerama_query_screens_screen_info(reply);
+		monitors.rects = erealloc(monitors.rects, n * sizeof(*monitors.rects));
+		for (i = 0; i < n; i++) {
+			monitors.rects[i] = (XRectangle){
+				.x      = info[i].x_org,
+				.y      = info[i].y_org,
+				.width  = info[i].width,
+				.height = info[i].height,
+			};
+		}
+		monitors.n = n;
+	} else {
+		monitors.rects = erealloc(monitors.rects, sizeof(*monitors.rects));
+		monitors.rects[0] = (XRectangle){
+			.x      = 0,
+			.y      = 0,
+			.width  = monitors.width,
+			.height = monitors.height,
+		};
+		monitors.n = 1;
+	}
+	free(reply);
 }
 
-/* setup the position of a menu */
-static void
-placemenu(struct Menu *menu, XRectangle *monitor, XPoint *pointer)
+/* check whether point is on rect */
+static int
+onrect(XRectangle *rect, XPoint *point)
+{
+	return BETWEEN(point->x, rect->x, rect->x + rect->width) &&
+	       BETWEEN(point->y, rect->y, rect->y + rect->height);
+}
+
+/* get the monitor the pointer is on; the layout is only queried if it is not known */
+static void
+getmonitor(XRectangle *monitor, XPoint *pointer)
+{
+	int i;
+
+	querymonitors();
+
+	/* the pointer is most often on the monitor it was on last time */
+	if (!onrect(&monitors.rects[monitors.last], pointer)) {
+		for (i = 0; i < monitors.n; i++) {
+			if (onrect(&monitors.rects[i], pointer)) {
+				monitors.last = i;
+				break;
+			}
+		}
+	}
+	*monitor = monitors.rects[monitors.last];
+}
+
+/* ask for the pointer position; the reply is collected by getpointer */
+static void
+askpointer(void)
+{
+	if (cookies.haspointer)
+		return;
+	cookies.pointer = xcb_query_pointer(pie.conn, pie.rootwin);
+	cookies.haspointer = 1;
+}
+
+/* get the pointer position, from the query sent by askpointer if it is still pending */
+static void
+getpointer(XPoint *pointer)
+{
+	xcb_query_pointer_reply_t *reply;
+
+	askpointer();
+	cookies.haspointer = 0;
+	if ((reply = getreply(cookies.pointer.sequence)) == NULL) {
+		pointer->x = pointer->y = 0;
+		return;
+	}
+	pointer->x = reply->root_x;
+	pointer->y = reply->root_y;
+	free(reply);
+}
+
+/* get notified of changes of the monitor layout; return the core events to select for it */
+static long
+watchmonitors(void)
+{
+	int errorbase;
+
+	if (!XRRQueryExtension(pie.display, &monitors.rrevent, &errorbase)) {
+		/* without RandR, only changes of the screen size are noticed */
+		monitors.rrevent = -1;
+		return StructureNotifyMask;
+	}
+	XRRSelectInput(pie.display, pie.rootwin, RRScreenChangeNotifyMask);
+	return NoEventMask;
+}
+
+/* forget the monitor layout if ev changed it; return whether ev is about the layout */
+static int
+changemonitors(XEvent *ev)
+{
+	if (monitors.rrevent != -1 && ev->type == monitors.rrevent + RRScreenChangeNotify) {
+		(void)XRRUpdateConfiguration(ev);
+		monitors.width = DisplayWidth(pie.display, pie.screen);
+		monitors.height = DisplayHeight(pie.display, pie.screen);
+	} else if (monitors.rrevent == -1 && ev->type == ConfigureNotify) {
+		monitors.width = ev->xconfigure.width;
+		monitors.height = ev->xconfigure.height;
+	} else {
+		return 0;
+	}
+	if (cookies.hasscreens) {
+		/* the layout asked for is out of date */
+		xcb_discard_reply(pie.conn, cookies.screens.sequence);
+		cookies.hasscreens = 0;
+	}
+	monitors.n = 0;
+	return 1;
+}
+
+/* try to grab pointer, we may have to wait for another process to ungrab */
+static void
+grabpointer(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (XGrabPointer(pie.display, pie.rootwin, True, ButtonPressMask,
+		                 GrabModeAsync, GrabModeAsync, None,
+		                 None, CurrentTime) == GrabSuccess)
+			return;
+		nanosleep(&ts, NULL);
+	}
+	errx(1, "could not grab pointer");
+}
+
+/* try to grab keyboard, we may have to wait for another process to ungrab */
+static void
+grabkeyboard(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (XGrabKeyboard(pie.display, pie.rootwin, True, GrabModeAsync,
+		                  GrabModeAsync, CurrentTime) == GrabSuccess)
+			return;
+		nanosleep(&ts, NULL);
+	}
+	errx(1, "could not grab keyboard");
+}
+
+/* place menu on the monitor, around the pointer if it is the root menu or around its caller slice */
+static void
+placemenu(struct Menu *menu, XRectangle *monitor, XPoint *pointer)
 {
-	struct Slice *slice;
 	XWindowChanges changes;
-	Window w1;  /* dummy variable */
 	int x, y;   /* position of the center of the menu */
-	Bool ret;
 
 	if (menu->parent == NULL) {
 		x = pointer->x;
 		y = pointer->y;
 	} else {
-		ret = XTranslateCoordinates(pie.display, menu->parent->win, pie.rootwin,
-		                            menu->caller->x, menu->caller->y,
-		                            &x, &y, &w1);
-		if (ret == False)
-			errx(EXIT_FAILURE, "menus are on different screens");
-	}
-	menu->x = monitor->x;
-	menu->y = monitor->y;
+		/* the parent has been placed already, no need to ask the server */
+		x = menu->parent->x + menu->parent->geom.x[menu->caller];
+		y = menu->parent->y + menu->parent->geom.y[menu->caller];
+	}
+	changes.x = monitor->x;
+	changes.y = monitor->y;
 	if (x - monitor->x >= pie.radius + pie.border) {
 		if (monitor->x + monitor->width - x >= pie.radius + pie.border)
-			menu->x = x - pie.radius - pie.border;
+			changes.x = x - pie.radius - pie.border;
 		else if (monitor->x + monitor->width >= pie.fulldiameter)
-			menu->x = monitor->x + monitor->width - pie.fulldiameter;
+			changes.x = monitor->x + monitor->width - pie.fulldiameter;
 	}
 	if (y - monitor->y >= pie.radius + pie.border) {
 		if (monitor->y + monitor->height - y >= pie.radius + pie.border)
-			menu->y = y - pie.radius - pie.border;
+			changes.y = y - pie.radius - pie.border;
 		else if (monitor->y + monitor->height >= pie.fulldiameter)
-			menu->y = monitor->y + monitor->height - pie.fulldiameter;
+			changes.y = monitor->y + monitor->height - pie.fulldiameter;
 	}
-	changes.x = menu->x;
-	changes.y = menu->y;
+	if (changes.x == menu->x && changes.y == menu->y)
+		return;
+	menu->x = changes.x;
+	menu->y = changes.y;
 	XConfigureWindow(pie.display, menu->win, CWX | CWY, &changes);
-	for (slice = menu->list; slice != NULL; slice = slice->next) {
-		if (slice->submenu != NULL) {
-			placemenu(slice->submenu, monitor, pointer);
-		}
-	}
 }
 
 /* get menu of given window */
@@ -953,37 +1668,99 @@ getmenu(struct Menu *currmenu, Window win)
 	return NULL;
 }
 
-/* get slice of given menu and position */
-static struct Slice *
-getslice(struct Menu *menu, int x, int y)
+/* check whether menu is currmenu or one of its ancestors */
+static int
+isvisible(struct Menu *menu, struct Menu *currmenu)
 {
-	struct Slice *slice;
-	double angle;
-	int r;
-
-	if (menu == NULL)
-		return NULL;
+	for (; currmenu != NULL; currmenu = currmenu->parent)
+		if (currmenu == menu)
+			return 1;
+	return 0;
+}
 
-	x -= pie.border + pie.radius;
-	y -= pie.border + pie.radius;
-	y = -y;
+/* get number + 1 of the slice at given position relative to the pie center */
+static unsigned
+slicenat(unsigned nslices, int x, int y)
+{
+	double angle, half;
+	int r;
 
 	/* if the cursor is in the middle circle, it is in no slice */
-	r = sqrt(x * x + y * y);
-	if (r <= pie.separatorbeg)
-		return NULL;
+	r = pie.separatorbeg + 1;
+	if (x * x + y * y < r * r)
+		return 0;
 
+	half = M_PI / nslices;
 	angle = atan2(y, x);
-	if (angle < 0.0) {
-		if (angle > -menu->half)
-			return menu->list;
+	if (angle < 0.0)
 		angle = (2 * M_PI) + angle;
+	return ((unsigned)((angle + half) / (2 * half)) % nslices) + 1;
+}
+
+/* get the hit map for menus with given number of slices; create it if needed */
+static unsigned short *
+gethitmap(unsigned nslices)
+{
+	struct HitMap *hitmap;
+	int x, y;
+
+	for (hitmap = pie.hitmaps; hitmap != NULL; hitmap = hitmap->next)
+		if (hitmap->nslices == nslices)
+			return hitmap->map;
+	if (nslices >= USHRT_MAX)
+		return NULL;
+	hitmap = emalloc(sizeof(*hitmap));
+	hitmap->nslices = nslices;
+	hitmap->map = emalloc(pie.fulldiameter * pie.fulldiameter * sizeof(*hitmap->map));
+	for (y = 0; y < pie.fulldiameter; y++) {
+		for (x = 0; x < pie.fulldiameter; x++) {
+			hitmap->map[y * pie.fulldiameter + x] = slicenat(
+				nslices,
+				x - pie.border - pie.radius,
+				pie.border + pie.radius - y
+			);
+		}
 	}
-	for (slice = menu->list; slice; slice = slice->next)
-		if (angle >= slice->anglea && angle < slice->angleb)
-			return slice;
+	hitmap->next = pie.hitmaps;
+	pie.hitmaps = hitmap;
+	return hitmap->map;
+}
 
-	return NULL;
+/* free hit maps */
+static void
+cleanhitmaps(void)
+{
+	struct HitMap *hitmap;
+
+	while ((hitmap = pie.hitmaps) != NULL) {
+		pie.hitmaps = hitmap->next;
+		free(hitmap->map);
+		free(hitmap);
+	}
+}
+
+/* get number of the slice of given menu and position */
+static int
+getslice(struct Menu *menu, int x, int y)
+{
+	unsigned n;
+
+	if (menu == NULL || menu->nslices == 0)
+		return NOSLICE;
+	if (menu->hitmap == NULL)
+		menu->hitmap = gethitmap(menu->nslices);
+	if (menu->hitmap != NULL &&
+	    BETWEEN(x, 0, pie.fulldiameter - 1) &&
+	    BETWEEN(y, 0, pie.fulldiameter - 1)) {
+		n = menu->hitmap[y * pie.fulldiameter + x];
+	} else {
+		n = slicenat(
+			menu->nslices,
+			x - pie.border - pie.radius,
+			pie.border + pie.radius - y
+		);
+	}
+	return (int)n - 1;
 }
 
 /* map tooltip and place it on given position */
@@ -991,7 +1768,7 @@ static void
 maptooltip(struct Slice *slice, XRectangle *monitor, XPoint *tooltippos)
 {
 	tooltippos->y += TTVERT;
-	if (slice->icon == NULL || slice->label == NULL)
+	if (slice->icon == None || slice->label == NULL)
 		return;
 	if (tooltippos->y + pie.tooltiph + 2 > monitor->y + monitor->height)
 		tooltippos->y = monitor->y + monitor->height - pie.tooltiph - 2;
@@ -1005,14 +1782,28 @@ maptooltip(struct Slice *slice, XRectangle *monitor, XPoint *tooltippos)
 static void
 unmaptooltip(struct Slice *slice)
 {
-	if (slice == NULL || slice->icon == NULL || slice->label == NULL)
+	if (slice == NULL || slice->icon == None || slice->label == NULL)
 		return;
 	XUnmapWindow(pie.display, slice->tooltip);
 }
 
-/* unmap previous menus; map current menu and its parents */
+/* place and map menu and its parents until lcamenu (exclusive), from the top down */
+static void
+mapmenus(struct Menu *menu, struct Menu *lcamenu, XRectangle *monitor)
+{
+	if (menu == lcamenu)
+		return;
+	mapmenus(menu->parent, lcamenu, monitor);
+	if (menu->geom.x == NULL)       /* not set up in idle time yet */
+		setmenu(menu);
+	if (menu->parent != NULL)
+		placemenu(menu, monitor, NULL);
+	XMapRaised(pie.display, menu->win);
+}
+
+/* unmap previous menus; place and map current menu and its parents */
 static struct Menu *
-mapmenu(struct Menu *currmenu, struct Menu *prevmenu)
+mapmenu(struct Menu *currmenu, struct Menu *prevmenu, XRectangle *monitor)
 {
 	struct Menu *menu, *menu_;
 	struct Menu *lcamenu;   /* lowest common ancestor menu */
@@ -1025,7 +1816,7 @@ mapmenu(struct Menu *currmenu, struct Menu *prevmenu)
 
 	/* if this is the first time mapping, skip calculations */
 	if (prevmenu == NULL) {
-		XMapRaised(pie.display, currmenu->win);
+		mapmenus(currmenu, NULL, monitor);
 		goto done;
 	}
 
@@ -1049,13 +1840,12 @@ mapmenu(struct Menu *currmenu, struct Menu *prevmenu)
 
 	/* unmap menus from currmenu (inclusive) until lcamenu (exclusive) */
 	for (menu = prevmenu; menu != lcamenu; menu = menu->parent) {
-		menu->selected = NULL;
+		menu->selected = NOSLICE;
 		XUnmapWindow(pie.display, menu->win);
 	}
 
 	/* map menus from currmenu (inclusive) until lcamenu (exclusive) */
-	for (menu = currmenu; menu != lcamenu; menu = menu->parent)
-		XMapRaised(pie.display, menu->win);
+	mapmenus(currmenu, lcamenu, monitor);
 
 done:
 	return currmenu;
@@ -1068,7 +1858,7 @@ unmapmenu(struct Menu *currmenu)
 	struct Menu *menu;
 
 	for (menu = currmenu; menu; menu = menu->parent) {
-		menu->selected = NULL;
+		menu->selected = NOSLICE;
 		XUnmapWindow(pie.display, menu->win);
 	}
 }
@@ -1120,12 +1910,12 @@ drawslice(Picture picture, Picture color, int nslices, int slicen, int beg, int
 
 /* draw separator before slice */
 static void
-drawseparator(Picture picture, struct Menu *menu, struct Slice *slice)
+drawseparator(Picture picture, unsigned nslices, int n)
 {
 	XPointDouble p[4];
 	double a;
 
-	a = -((M_PI + 2 * M_PI * slice->slicen) / menu->nslices);
+	a = -((M_PI + 2 * M_PI * n) / nslices);
 	p[0].x = pie.border + pie.radius + pie.separatorbeg * cos(a - pie.innerangle);
 	p[0].y = pie.border + pie.radius + pie.separatorbeg * sin(a - pie.innerangle);
 	p[1].x = pie.border + pie.radius + pie.separatorbeg * cos(a + pie.innerangle);
@@ -1146,12 +1936,12 @@ drawseparator(Picture picture, struct Menu *menu, struct Slice *slice)
 
 /* draw triangle for slice with submenu */
 static void
-drawtriangle(Picture source, Picture picture, struct Menu *menu, struct Slice *slice)
+drawtriangle(Picture source, Picture picture, unsigned nslices, int n)
 {
 	XPointDouble p[3];
 	double a;
 
-	a = - (((2 * M_PI) / menu->nslices) * slice->slicen);
+	a = - (((2 * M_PI) / nslices) * n);
 	p[0].x = pie.border + pie.radius + pie.triangleinner * cos(a - pie.triangleangle);
 	p[0].y = pie.border + pie.radius + pie.triangleinner * sin(a - pie.triangleangle);
 	p[1].x = pie.border + pie.radius + pie.triangleouter * cos(a);
@@ -1168,27 +1958,154 @@ drawtriangle(Picture source, Picture picture, struct Menu *menu, struct Slice *s
 	);
 }
 
+/* create a mask of the size of the pie, with nothing drawn on it */
+static Picture
+createmask(void)
+{
+	Picture picture;
+	Pixmap pixmap;
+
+	pixmap = XCreatePixmap(pie.display, pie.rootwin, pie.fulldiameter, pie.fulldiameter, 8);
+	picture = XRenderCreatePicture(pie.display, pixmap, pie.alphaformat, 0, NULL);
+	XFreePixmap(pie.display, pixmap);
+	XRenderFillRectangle(
+		pie.display,
+		PictOpSrc,
+		picture,
+		&(XRenderColor){ 0 },
+		0, 0,
+		pie.fulldiameter,
+		pie.fulldiameter
+	);
+	return picture;
+}
+
+/* get masks for pies with nslices slices, drawing the separators if they are not drawn yet */
+/* shapes are drawn on masks through the foreground color, which is always opaque */
+static struct Masks *
+getmasks(unsigned nslices)
+{
+	struct Masks *masks;
+	unsigned n;
+
+	if (pie.disc == None) {
+		pie.disc = createmask();
+		drawslice(pie.disc, pie.colors[SCHEME_NORMAL][COLOR_FG].pict, 1, 0, 0, pie.radius);
+	}
+	for (masks = pie.masks; masks != NULL; masks = masks->next)
+		if (masks->nslices == nslices)
+			return masks;
+	masks = emalloc(sizeof(*masks));
+	masks->nslices = nslices;
+	masks->wedges = emalloc(2 * nslices * sizeof(*masks->wedges));
+	masks->triangles = masks->wedges + nslices;
+	for (n = 0; n < nslices; n++)
+		masks->wedges[n] = masks->triangles[n] = None;
+	masks->separators = createmask();
+	for (n = 0; n < nslices; n++)
+		drawseparator(masks->separators, nslices, n);
+	masks->next = pie.masks;
+	pie.masks = masks;
+	return masks;
+}
+
+/* get mask of the wedge of slice n */
+static Picture
+getwedge(struct Masks *masks, int n)
+{
+	if (masks->wedges[n] == None) {
+		masks->wedges[n] = createmask();
+		drawslice(
+			masks->wedges[n],
+			pie.colors[SCHEME_NORMAL][COLOR_FG].pict,
+			masks->nslices,
+			n,
+			pie.separatorbeg,
+			pie.radius
+		);
+	}
+	return masks->wedges[n];
+}
+
+/* get mask of the triangle of slice n */
+static Picture
+gettriangle(struct Masks *masks, int n)
+{
+	if (masks->triangles[n] == None) {
+		masks->triangles[n] = createmask();
+		drawtriangle(
+			pie.colors[SCHEME_NORMAL][COLOR_FG].pict,
+			masks->triangles[n],
+			masks->nslices,
+			n
+		);
+	}
+	return masks->triangles[n];
+}
+
+/* composite color through mask onto the pie on picture */
+static void
+fillmask(Picture picture, Picture color, Picture mask)
+{
+	XRenderComposite(
+		pie.display,
+		PictOpOver,
+		color,
+		mask,
+		picture,
+		0, 0,
+		0, 0,
+		0, 0,
+		pie.fulldiameter,
+		pie.fulldiameter
+	);
+}
+
+/* free masks */
+static void
+cleanmasks(void)
+{
+	struct Masks *masks;
+	unsigned n;
+
+	while ((masks = pie.masks) != NULL) {
+		pie.masks = masks->next;
+		XRenderFreePicture(pie.display, masks->separators);
+		for (n = 0; n < 2 * masks->nslices; n++)
+			if (masks->wedges[n] != None)
+				XRenderFreePicture(pie.display, masks->wedges[n]);
+		free(masks->wedges);
+		free(masks);
+	}
+	if (pie.disc != None)
+		XRenderFreePicture(pie.display, pie.disc);
+	pie.disc = None;
+}
+
 /* draw regular slice */
 static void
-drawmenu(struct Menu *menu, struct Slice *selected)
+drawmenu(struct Menu *menu, int selected)
 {
 	struct Slice *slice;
-	Drawable pixmap;
+	struct Masks *masks;
 	Picture picture;
 	Picture source;
 	Picture fg;
+	int n;
 
-	if (selected) {
-		pixmap = selected->pixmap;
-		picture = selected->picture;
+	if (selected != NOSLICE) {
+		picture = menu->slices[selected].picture;
 		fg = pie.colors[SCHEME_SELECT][COLOR_FG].pict;
-		selected->drawn = 1;
+		menu->slices[selected].drawn = 1;
 	} else {
-		pixmap = menu->pixmap;
 		picture = menu->picture;
 		fg = pie.colors[SCHEME_NORMAL][COLOR_FG].pict;
 		menu->drawn = 1;
 	}
+	stats.ndraws++;
+
+	/* only composite requests are sent; shapes and icons are on the server already */
+	masks = getmasks(menu->nslices);
 
 	XRenderComposite(
 		pie.display,
@@ -1202,45 +2119,42 @@ drawmenu(struct Menu *menu, struct Slice *selected)
 		pie.fulldiameter,
 		pie.fulldiameter
 	);
-	drawslice(
-		picture,
-		pie.colors[SCHEME_NORMAL][COLOR_BG].pict,
-		1,
-		0,
-		0,
-		pie.radius
-	);
-	if (selected != NULL) {
-		drawslice(
-			picture,
-			pie.colors[SCHEME_SELECT][COLOR_BG].pict,
-			menu->nslices,
-			selected->slicen,
-			pie.separatorbeg,
-			pie.radius
-		);
+	fillmask(picture, pie.colors[SCHEME_NORMAL][COLOR_BG].pict, pie.disc);
+	if (selected != NOSLICE) {
+		fillmask(picture, pie.colors[SCHEME_SELECT][COLOR_BG].pict, getwedge(masks, selected));
 	}
 
 	/* draw slice foreground */
-	for (slice = menu->list; slice; slice = slice->next) {
-		if (slice == selected) {
+	for (n = 0; n < (int)menu->nslices; n++) {
+		slice = &menu->slices[n];
+		if (n == selected) {
 			source = pie.colors[SCHEME_SELECT][COLOR_FG].pict;
 		} else {
 			source = pie.colors[SCHEME_NORMAL][COLOR_FG].pict;
 		}
 
-		if (slice->icon != NULL) {      /* if there is an icon, draw it */
-			imlib_context_set_drawable(pixmap);
-			imlib_context_set_image(slice->icon);
-			imlib_render_image_on_drawable(slice->iconx, slice->icony);
+		if (slice->icon != None) {      /* if there is an icon, draw it */
+			XRenderComposite(
+				pie.display,
+				PictOpOver,
+				slice->icon,
+				None,
+				picture,
+				0, 0,
+				0, 0,
+				menu->geom.iconx[n],
+				menu->geom.icony[n],
+				slice->iconw,
+				slice->iconh
+			);
 		} else {                        /* otherwise, draw the label */
 			ctrlfnt_draw(
 				pie.fontset,
 				picture,
 				fg,
 				(XRectangle){
-					.x = slice->labelx,
-					.y = slice->labely,
+					.x = menu->geom.labelx[n],
+					.y = menu->geom.labely[n],
 					.width = pie.radius,
 					.height = pie.fonth,
 				},
@@ -1249,14 +2163,14 @@ drawmenu(struct Menu *menu, struct Slice *selected)
 			);
 		}
 
-		/* draw separator */
-		drawseparator(picture, menu, slice);
-
 		/* draw triangle */
 		if (slice->submenu || slice->iscmd) {
-			drawtriangle(source, picture, menu, slice);
+			fillmask(picture, source, gettriangle(masks, n));
 		}
 	}
+
+	/* draw separators */
+	fillmask(picture, pie.colors[SCHEME_NORMAL][COLOR_FG].pict, masks->separators);
 }
 
 /* draw tooltip of slice */
@@ -1307,439 +2221,1940 @@ copymenu(struct Menu *currmenu)
 	struct Menu *menu;
 	Drawable pixmap;
 
+	(void)setphase(PHASE_DRAW);
 	for (menu = currmenu; menu != NULL; menu = menu->parent) {
-		if (menu->selected) {
-			pixmap = menu->selected->pixmap;
-			if (!menu->selected->drawn)
+		if (menu->selected != NOSLICE) {
+			pixmap = menu->slices[menu->selected].pixmap;
+			if (!menu->slices[menu->selected].drawn)
 				drawmenu(menu, menu->selected);
 		} else {
 			pixmap = menu->pixmap;
 			if (!menu->drawn)
-				drawmenu(menu, NULL);
+				drawmenu(menu, NOSLICE);
 		}
 		XSetWindowBackgroundPixmap(pie.display, menu->win, pixmap);
 		XClearWindow(pie.display, menu->win);
+		stats.nrepaints++;
+	}
+	if (profile.running) {
+		/* the first menu is drawn, startup is over */
+		XSync(pie.display, False);
+		endprofile(pie.display);
 	}
 }
 
 /* cycle through the slices; non-zero direction is next, zero is prev */
-static struct Slice *
+static int
 slicecycle(struct Menu *currmenu, int clockwise)
 {
-	struct Slice *slice;
-	struct Slice *lastslice;
-
-	slice = NULL;
-	if (clockwise) {
-		for (lastslice = currmenu->list;
-		     lastslice != NULL && lastslice->next != NULL;
-		     lastslice = lastslice->next)
-			;
-		if (currmenu->selected == NULL)
-			slice = currmenu->list;
-		else if (currmenu->selected->prev != NULL)
-			slice = currmenu->selected->prev;
-		if (slice == NULL)
-			slice = lastslice;
-	} else {
-		if (currmenu->selected == NULL)
-			slice = currmenu->list;
-		else if (currmenu->selected->next != NULL)
-			slice = currmenu->selected->next;
-		if (slice == NULL)
-			slice = currmenu->list;
-	}
-	return slice;
+	if (currmenu->selected == NOSLICE)
+		return 0;
+	if (clockwise)
+		return (currmenu->selected + currmenu->nslices - 1) % currmenu->nslices;
+	return (currmenu->selected + 1) % currmenu->nslices;
 }
 
-/* recursivelly free pixmaps and destroy windows */
-static void
-cleanmenu(struct Menu *menu)
+/* compare labels ignoring case, for the type-ahead index */
+static int
+labelcmp(const void *a, const void *b)
 {
-	struct Slice *slice;
-	struct Slice *tmp;
+	const struct Label *la = a;
+	const struct Label *lb = b;
+	int cmp;
 
-	if (menu == NULL)
-		return;
-	slice = menu->list;
-	while (slice != NULL) {
-		if (slice->submenu != NULL)
-			cleanmenu(slice->submenu);
-		tmp = slice;
-		if (tmp->label != tmp->output)
-			free(tmp->label);
-		free(tmp->output);
-		XFreePixmap(pie.display, slice->pixmap);
-		if (slice->tooltip != None)
-			XDestroyWindow(pie.display, slice->tooltip);
-		if (slice->ttpix != None)
-			XFreePixmap(pie.display, slice->ttpix);
-		if (slice->ttpict != None)
-			XRenderFreePicture(pie.display, slice->ttpict);
-		if (tmp->file != NULL)
-			free(tmp->file);
-		if (tmp->icon != NULL) {
-			imlib_context_set_image(tmp->icon);
-			imlib_free_image_and_decache();
-		}
-		slice = slice->next;
-		free(tmp);
-	}
-
-	XFreePixmap(pie.display, menu->pixmap);
-	XDestroyWindow(pie.display, menu->win);
-	free(menu);
+	if ((cmp = strcasecmp(la->label, lb->label)) != 0)
+		return cmp;
+	return la->slicen - lb->slicen;
 }
 
-/* clear menus generated via genmenu */
-static void
-cleangenmenu(struct Menu *menu)
+/* get first slice, in label order, whose label begins with prefix */
+static int
+findlabel(struct Menu *menu, const char *prefix, size_t len)
 {
-	struct Slice *slice;
-
-	for (slice = menu->list; slice; slice = slice->next) {
-		if (slice->submenu != NULL)
-			cleangenmenu(slice->submenu);
-		if (slice->iscmd == CMD_RUN) {
-			cleanmenu(slice->submenu);
-			slice->iscmd = CMD_NOTRUN;
-			slice->submenu = NULL;
+	unsigned lo, hi, mid;
+	unsigned n;
+
+	/* the index is built when first typing into the menu */
+	if (menu->labels == NULL) {
+		menu->labels = emalloc(MAX(menu->nslices, 1) * sizeof(*menu->labels));
+		menu->nlabels = 0;
+		for (n = 0; n < menu->nslices; n++) {
+			if (menu->slices[n].output == NULL)
+				continue;
+			menu->labels[menu->nlabels++] = (struct Label){
+				.label = (menu->slices[n].label != NULL) ? menu->slices[n].label : "",
+				.slicen = n,
+			};
 		}
+		qsort(menu->labels, menu->nlabels, sizeof(*menu->labels), labelcmp);
 	}
-}
-
-/* run command of slice to generate a submenu */
-static struct Menu *
-genmenu(struct Menu *menu, struct Slice *slice, XRectangle *monitor, XPoint *pointer)
-{
-	FILE *fp;
 
-	if ((fp = popen(slice->output, "r")) == NULL) {
-		warnx("could not run: %s", slice->output);
-		return NULL;
-	}
-	if ((slice->submenu = parse(fp, menu->level + 1)) == NULL)
-		return NULL;
-	pclose(fp);
-	slice->submenu->parent = menu;
-	slice->submenu->caller = slice;
-	slice->iscmd = CMD_RUN;
-	setslices(slice->submenu);
-	placemenu(slice->submenu, monitor, pointer);
-	if (slice->submenu->list == NULL) {
-		cleanmenu(slice->submenu);
-		return NULL;
+	/* labels beginning with prefix are contiguous; find the first one */
+	for (lo = 0, hi = menu->nlabels; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (strncasecmp(menu->labels[mid].label, prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return slice->submenu;
+	if (lo == menu->nlabels || strncasecmp(menu->labels[lo].label, prefix, len) != 0)
+		return NOSLICE;
+	return menu->labels[lo].slicen;
 }
 
-/* ungrab pointer and keyboard */
+/* free pixmaps and destroy windows of slice, so it is set up again */
 static void
-ungrab(void)
+unsetslice(struct Slice *slice)
 {
-	XUngrabPointer(pie.display, CurrentTime);
-	XUngrabKeyboard(pie.display, CurrentTime);
+	if (slice->picture != None)
+		XRenderFreePicture(pie.display, slice->picture);
+	if (slice->pixmap != None)
+		XFreePixmap(pie.display, slice->pixmap);
+	if (slice->tooltip != None)
+		XDestroyWindow(pie.display, slice->tooltip);
+	if (slice->ttpix != None)
+		XFreePixmap(pie.display, slice->ttpix);
+	if (slice->ttpict != None)
+		XRenderFreePicture(pie.display, slice->ttpict);
+	slice->picture = None;
+	slice->pixmap = None;
+	slice->tooltip = None;
+	slice->ttpix = None;
+	slice->ttpict = None;
+	slice->ttw = 0;
+	slice->labelw = 0;
 }
 
-/* create tooltip */
+/* free slice */
 static void
-tooltip(struct Menu *currmenu, XEvent *ev)
+cleanslice(struct Slice *slice)
 {
-	struct Menu *menu = NULL;
-	struct Slice *slice = NULL;
-
-	while (!XNextEvent(pie.display, ev)) {
-		switch (ev->type) {
-		case MotionNotify:
-			menu = getmenu(currmenu, ev->xmotion.window);
-			slice = getslice(menu, ev->xmotion.x, ev->xmotion.y);
-			if ((menu != NULL && menu != currmenu) || slice != currmenu->selected) {
-				/* motion off selected slice */
-				return;
-			}
-			break;
-		case LeaveNotify:
-		case ButtonRelease:
-		case ButtonPress:
-		case KeyPress:
-		case ConfigureNotify:
-			return;
-		}
+	if (slice->label != slice->output)
+		free(slice->label);
+	free(slice->output);
+	unsetslice(slice);
+	if (slice->file != NULL)
+		free(slice->file);
+	if (slice->image != NULL) {
+		imlib_context_set_image(slice->image);
+		imlib_free_image();
 	}
+	if (slice->icon != None)
+		XRenderFreePicture(pie.display, slice->icon);
 }
 
-/* item was entered, print its output or run it */
+/* stop tracking prefetched menu, as it has been opened or freed */
 static void
-enteritem(struct Slice *slice)
+forgetprefetch(struct Menu *menu)
 {
-	if (execcommand) {
-		if (efork() == 0) {
-			if (efork() == 0) {
-				eexecsh(slice->output);
-				exit(1);
-			}
-			exit(1);
+	int i;
+
+	for (i = 0; i < nprefetched; i++) {
+		if (prefetched[i] == menu) {
+			prefetched[i] = prefetched[--nprefetched];
+			return;
 		}
-		wait(NULL);
-	} else {
-		printf("%s\n", slice->output);
-		fflush(stdout);
 	}
 }
 
+/* recursivelly free pixmaps and destroy windows */
 static void
-warppointer(struct Menu *currmenu)
+cleanmenu(struct Menu *menu)
 {
-	XWarpPointer(
-		pie.display,
-		None,
-		currmenu->win,
-		0, 0, 0, 0,
-		pie.radius + pie.border,
-		pie.radius + pie.border
-	);
+	unsigned n;
+
+	if (menu == NULL)
+		return;
+	forgetprefetch(menu);
+	for (n = 0; n < menu->nslices; n++) {
+		if (menu->slices[n].submenu == NULL)
+			;
+		else if (menu->slices[n].submenu->cached)
+			menu->slices[n].submenu->parent = NULL;
+		else
+			cleanmenu(menu->slices[n].submenu);
+		cleanslice(&menu->slices[n]);
+	}
+
+	if (menu->picture != None)
+		XRenderFreePicture(pie.display, menu->picture);
+	if (menu->pixmap != None)
+		XFreePixmap(pie.display, menu->pixmap);
+	if (menu->win != None)
+		XDestroyWindow(pie.display, menu->win);
+	free(menu->geom.x);
+	free(menu->labels);
+	free(menu->slices);
+	free(menu);
+}
+
+/* check whether two strings, any of which may be NULL, are equal */
+static int
+strsame(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+/* check whether two slices are built from the same item */
+static int
+sameslice(struct Slice *a, struct Slice *b)
+{
+	return (a->iscmd == NO_CMD) == (b->iscmd == NO_CMD) &&
+	       strsame(a->label, b->label) &&
+	       strsame(a->output, b->output) &&
+	       strsame(a->file, b->file);
 }
 
+/* adopt submenu just parsed as the submenu of slice n of menu, and set it up */
 static void
-run(struct pollfd *pfd, struct Menu *rootmenu, XRectangle *monitor, XPoint *pointer)
+adoptmenu(struct Menu *menu, int n, struct Menu *submenu)
 {
-	struct Menu *currmenu;
-	struct Menu *prevmenu;
-	struct Menu *menu = NULL;
-	struct Slice *slice = NULL;
-	KeySym ksym;
-	XEvent ev;
-	XPoint tooltippos = { 0 };
-	int timeout;
-	int nready;
+	submenu->parent = menu;
+	submenu->caller = n;
+	setslices(submenu);
+}
 
-	if (rootmenu == NULL)
-		return;
-	nready = 3;
-	timeout = -1;
-	prevmenu = currmenu = rootmenu;
-	while (XPending(pie.display) || (nready = poll(pfd, 1, timeout)) != -1) {
-		if (nready == 0 && currmenu != NULL && currmenu->selected != NULL) {
-			if (!currmenu->selected->ttdrawn)
-				drawtooltip(currmenu->selected);
-			maptooltip(currmenu->selected, monitor, &tooltippos);
-			tooltip(currmenu, &ev);
-			unmaptooltip(currmenu->selected);
-		} else {
-			XNextEvent(pie.display, &ev);
-		}
-		switch (ev.type) {
-		case MotionNotify:
-			timeout = -1;
-			menu = getmenu(currmenu, ev.xmotion.window);
-			slice = getslice(menu, ev.xmotion.x, ev.xmotion.y);
-			if (menu == NULL)
-				break;
-			if (nowarpflag) {
-				menu->selected = slice;
-			} else if (currmenu != rootmenu && menu != currmenu) {
-				/* motion off a non-root menu */
-				currmenu = currmenu->parent;
-				prevmenu = mapmenu(currmenu, prevmenu);
-				currmenu->selected = NULL;
-				copymenu(currmenu);
-			}
-			if (menu == currmenu) {
-				/* motion inside a menu */
-				currmenu->selected = slice;
-				timeout = 1000;
-				tooltippos.x = ev.xmotion.x_root;
-				tooltippos.y = ev.xmotion.y_root;
-			}
-			copymenu(currmenu);
-			break;
-		case ButtonRelease:
-			timeout = -1;
-			if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3)
-				break;
-			menu = getmenu(currmenu, ev.xbutton.window);
-			slice = getslice(menu, ev.xbutton.x, ev.xbutton.y);
-			if (menu == NULL || slice == NULL)
-				break;
-selectslice:
-			if (slice->submenu) {
-				currmenu = slice->submenu;
-			} else if (slice->iscmd == CMD_NOTRUN) {
-				if ((menu = genmenu(menu, slice, monitor, pointer)) != NULL) {
-					currmenu = menu;
-				}
-			} else {
-				enteritem(slice);
-				goto done;
-			}
-			prevmenu = mapmenu(currmenu, prevmenu);
-			currmenu->selected = NULL;
-			copymenu(currmenu);
-			if (!nowarpflag) 
-				warppointer(currmenu);
-			break;
-		case LeaveNotify:
-			if (!(ev.xcrossing.state & (Button1Mask | Button3Mask)))
-				break;
-			menu = getmenu(currmenu, ev.xcrossing.window);
-			slice = getslice(menu, ev.xcrossing.x, ev.xcrossing.y);
-			if (menu == NULL || slice == NULL)
-				break;
-			if (slice == currmenu->selected &&
-			    (slice->submenu != NULL || slice->iscmd == CMD_NOTRUN))
-				goto selectslice;
-			break;
-		case ButtonPress:
-			timeout = -1;
-			if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3)
+/* merge newmenu, just parsed, into menu; newmenu is freed */
+/* slices found in both menus are kept as set up, and menus whose slices are kept in place are not laid out again */
+static void
+mergemenu(struct Menu *menu, struct Menu *newmenu)
+{
+	struct Slice *slices = newmenu->slices;
+	struct Menu *submenu;
+	unsigned char *kept;
+	unsigned i, j;
+	int changed;
+
+	changed = (menu->nslices != newmenu->nslices);
+	kept = emalloc(menu->nslices);
+	memset(kept, 0, menu->nslices);
+	for (i = 0; i < newmenu->nslices; i++) {
+		for (j = 0; j < menu->nslices; j++)
+			if (!kept[j] && sameslice(&menu->slices[j], &slices[i]))
 				break;
-			menu = getmenu(currmenu, ev.xbutton.window);
-			slice = getslice(menu, ev.xbutton.x, ev.xbutton.y);
-			if (menu == NULL || slice == NULL)
-				goto done;
-			break;
-		case KeyPress:
-			timeout = -1;
-			ksym = XkbKeycodeToKeysym(pie.display, ev.xkey.keycode, 0, 0);
+		if (j == menu->nslices) {
+			/* new slice, it is set up from scratch */
+			changed = 1;
+			if (slices[i].submenu != NULL)
+				adoptmenu(menu, i, slices[i].submenu);
+			continue;
+		}
 
-			/* esc closes pmenu when current menu is the root menu */
-			if (ksym == XK_Escape && currmenu->parent == NULL)
-				goto done;
+		/* replace the new slice with the old one */
+		kept[j] = 1;
+		if (i != j)
+			changed = 1;
+		submenu = slices[i].submenu;
+		cleanslice(&slices[i]);
+		slices[i] = menu->slices[j];
+		if (slices[i].submenu != NULL && submenu != NULL) {
+			slices[i].submenu->caller = i;
+			mergemenu(slices[i].submenu, submenu);
+		} else if (slices[i].submenu != NULL) {
+			cleanmenu(slices[i].submenu);
+			slices[i].submenu = NULL;
+			changed = 1;
+		} else if (submenu != NULL) {
+			slices[i].submenu = submenu;
+			adoptmenu(menu, i, submenu);
+			changed = 1;
+		}
+	}
 
-			/* Shift-Tab = ISO_Left_Tab */
-			if (ksym == XK_Tab && (ev.xkey.state & ShiftMask))
-				ksym = XK_ISO_Left_Tab;
+	/* free the slices gone from the menu */
+	for (j = 0; j < menu->nslices; j++) {
+		if (kept[j])
+			continue;
+		cleanmenu(menu->slices[j].submenu);
+		cleanslice(&menu->slices[j]);
+	}
+	free(kept);
+
+	/* icons are sized to the slice angle; rescale the kept ones if it has changed */
+	if (menu->nslices != newmenu->nslices) {
+		for (i = 0; i < newmenu->nslices; i++) {
+			if (slices[i].icon == None)
+				continue;
+			XRenderFreePicture(pie.display, slices[i].icon);
+			slices[i].icon = None;
+			unsetslice(&slices[i]);
+		}
+	}
 
-			/* cycle through menu */
-			slice = NULL;
-			if (ksym == XK_Tab) {
-				slice = slicecycle(currmenu, 1);
-			} else if (ksym == XK_ISO_Left_Tab) {
-				slice = slicecycle(currmenu, 0);
-			} else if ((ksym == XK_Return) &&
-			           currmenu->selected != NULL) {
-				slice = currmenu->selected;
-				menu = currmenu;
-				goto selectslice;
-			} else if ((ksym == XK_Escape) &&
-			           currmenu->parent != NULL) {
-				slice = currmenu->parent->selected;
-				currmenu = currmenu->parent;
-				prevmenu = mapmenu(currmenu, prevmenu);
-			} else
-				break;
-			currmenu->selected = slice;
-			copymenu(currmenu);
-			break;
-		case ConfigureNotify:
-			menu = getmenu(currmenu, ev.xconfigure.window);
-			if (menu == NULL)
-				break;
-			menu->x = ev.xconfigure.x;
-			menu->y = ev.xconfigure.y;
-			break;
+	free(menu->slices);
+	menu->slices = slices;
+	menu->nslices = newmenu->nslices;
+	menu->maxslices = newmenu->maxslices;
+	free(newmenu);
+	if (changed) {
+		free(menu->labels);
+		menu->labels = NULL;
+		menu->selected = NOSLICE;
+		setmenu(menu);
+	}
+}
+
+/* add the leaves of menu into the search index; path holds the labels leading to menu */
+static void
+indexleaves(struct Menu *menu, char *path, size_t len)
+{
+	struct Slice *slice;
+	const char *label;
+	unsigned n;
+	int r;
+
+	for (n = 0; n < menu->nslices; n++) {
+		slice = &menu->slices[n];
+		label = (slice->label != NULL) ? slice->label : "";
+		r = snprintf(path + len, BUFSIZ - len, "%s%s", (len > 0) ? "/" : "", label);
+		if (r < 0 || (size_t)r >= BUFSIZ - len)
+			r = BUFSIZ - len - 1;
+		if (slice->submenu != NULL) {
+			indexleaves(slice->submenu, path, len + r);
+			continue;
 		}
-		XFlush(pie.display);
+		if (slice->iscmd != NO_CMD || slice->output == NULL)
+			continue;
+		if (search.nleaves == search.maxleaves) {
+			search.maxleaves = (search.maxleaves == 0) ? 64 : search.maxleaves * 2;
+			search.leaves = erealloc(
+				search.leaves,
+				search.maxleaves * sizeof(*search.leaves)
+			);
+		}
+		search.leaves[search.nleaves++] = (struct Leaf){
+			.menu = menu,
+			.slicen = n,
+			.path = estrdup(path),
+		};
 	}
-	if (nready == -1)
-		err(1, "poll");
-done:
-	unmapmenu(currmenu);
-	ungrab();
-	cleangenmenu(rootmenu);
+	path[len] = '\0';
 }
 
-static char *
-getresource(XrmDatabase xdb, enum Resource resource)
+/* build the search index of the leaves of the menu tree */
+static void
+buildindex(struct Menu *rootmenu)
 {
-	XrmQuark name[] = {
-		pie.application.name,
-		pie.resources[resource].name,
-		NULLQUARK,
-	};
-	XrmQuark class[] = {
-		pie.application.class,
-		pie.resources[resource].class,
-		NULLQUARK,
-	};
-	XrmRepresentation tmp;
-	XrmValue xval;
+	char path[BUFSIZ];
 
-	if (XrmQGetResource(xdb, name, class, &tmp, &xval))
-		return xval.addr;
-	return NULL;
+	path[0] = '\0';
+	indexleaves(rootmenu, path, 0);
+	search.matches = emalloc(MAX(search.nleaves, 1) * sizeof(*search.matches));
+	search.root = rootmenu;
+}
+
+/* get how well the characters of query appear in order in s, or -1 if they do not */
+static int
+fuzzyscore(const char *s, const char *query, size_t len)
+{
+	const char *beg = s;
+	const char *prev = NULL;
+	int score = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++, s++) {
+		for (; *s != '\0'; s++)
+			if (tolower((unsigned char)*s) == tolower((unsigned char)query[i]))
+				break;
+		if (*s == '\0')
+			return -1;
+		score++;
+		if (prev != NULL && s == prev + 1)
+			score += 2;     /* consecutive characters */
+		if (s == beg || strchr("/ -_", s[-1]) != NULL)
+			score += 3;     /* beginning of a word */
+		prev = s;
+	}
+	return score;
+}
+
+/* compare matches, best first */
+static int
+matchcmp(const void *a, const void *b)
+{
+	const struct Match *ma = a;
+	const struct Match *mb = b;
+
+	if (ma->score != mb->score)
+		return mb->score - ma->score;
+	return ma->leafn - mb->leafn;
 }
 
+/* match leaves against the query; if it has grown, only the previous matches are tried */
 static void
-setcolor(int scheme, int colornum, const char *colorname)
+matchleaves(int grown)
 {
-	XColor color;
+	int i, n, score;
+
+	n = 0;
+	if (grown) {
+		for (i = 0; i < search.nmatches; i++) {
+			score = fuzzyscore(search.leaves[search.matches[i].leafn].path, search.query, search.nquery);
+			if (score >= 0) {
+				search.matches[n].leafn = search.matches[i].leafn;
+				search.matches[n++].score = score;
+			}
+		}
+	} else {
+		for (i = 0; i < search.nleaves; i++) {
+			score = fuzzyscore(search.leaves[i].path, search.query, search.nquery);
+			if (score >= 0) {
+				search.matches[n].leafn = i;
+				search.matches[n++].score = score;
+			}
+		}
+	}
+	search.nmatches = n;
+	search.page = 0;
+	qsort(search.matches, search.nmatches, sizeof(*search.matches), matchcmp);
+}
 
-	if (colorname == NULL)
-		return;
-	if (!XParseColor(pie.display, pie.colormap, colorname, &color)) {
-		warnx("%s: unknown color name", colorname);
+/* fill the search menu with the current page of matches */
+static void
+showmatches(void)
+{
+	struct Menu *menu = search.menu;
+	struct Leaf *leaf;
+	struct Slice *slice;
+	char query[MAXTYPED + 1];
+	unsigned n;
+	int i;
+
+	for (n = 0; n < menu->nslices; n++)
+		cleanslice(&menu->slices[n]);
+	menu->nslices = 0;
+	free(menu->labels);
+	menu->labels = NULL;
+	for (i = search.page * NRESULTS; i < search.nmatches && i < (search.page + 1) * NRESULTS; i++) {
+		leaf = &search.leaves[search.matches[i].leafn];
+		slice = &leaf->menu->slices[leaf->slicen];
+		(void)addslice(menu, slice->label, slice->output, NULL);
+	}
+	if (menu->nslices == 0) {
+		/* a placeholder showing the query that matched nothing */
+		(void)snprintf(query, sizeof(query), "%.*s", (int)search.nquery, search.query);
+		(void)addslice(menu, query, NULL, NULL);
+	}
+	menu->selected = (menu->slices[0].output != NULL) ? 0 : NOSLICE;
+	setslices(menu);
+}
+
+/* free the search menu */
+static void
+endsearch(void)
+{
+	if (search.menu == NULL)
 		return;
+	cleanmenu(search.menu);
+	search.menu = NULL;
+}
+
+/* free the search index */
+static void
+cleanindex(void)
+{
+	int i;
+
+	endsearch();
+	for (i = 0; i < search.nleaves; i++)
+		free(search.leaves[i].path);
+	free(search.leaves);
+	free(search.matches);
+	search.leaves = NULL;
+	search.matches = NULL;
+	search.nleaves = search.maxleaves = 0;
+	search.root = NULL;
+}
+
+/* open the search menu from currmenu, showing every leaf */
+static struct Menu *
+startsearch(struct Menu *currmenu)
+{
+	struct Menu *rootmenu;
+
+	/* the index is built when the menu tree is first searched */
+	for (rootmenu = currmenu; rootmenu->parent != NULL; rootmenu = rootmenu->parent)
+		;
+	if (search.root != rootmenu) {
+		cleanindex();
+		buildindex(rootmenu);
 	}
-	pie.colors[scheme][colornum].chans = (XRenderColor){
-		.red   = FLAG(color.flags, DoRed)   ? color.red   : 0x0000,
-		.green = FLAG(color.flags, DoGreen) ? color.green : 0x0000,
-		.blue  = FLAG(color.flags, DoBlue)  ? color.blue  : 0x0000,
-		.alpha = 0xFFFF,
-	};
-	XRenderFillRectangle(
-		pie.display,
-		PictOpSrc,
-		pie.colors[scheme][colornum].pict,
-		&pie.colors[scheme][colornum].chans,
-		0, 0, 1, 1
-	);
+	search.menu = allocmenu(currmenu, currmenu->level + 1);
+	search.menu->caller = (currmenu->selected != NOSLICE) ? currmenu->selected : 0;
+	search.nquery = 0;
+	matchleaves(0);
+	showmatches();
+	return search.menu;
+}
+
+/* change the search according to the key typed into the search menu; return whether it changed */
+static int
+typesearch(XKeyEvent *kev, KeySym ksym)
+{
+	char *s;
+
+	s = search.query + search.nquery;
+	if (ksym == XK_BackSpace && search.nquery > 0) {
+		search.nquery--;
+		matchleaves(0);
+	} else if (ksym == XK_Next && (search.page + 1) * NRESULTS < search.nmatches) {
+		search.page++;
+	} else if (ksym == XK_Prior && search.page > 0) {
+		search.page--;
+	} else if (XLookupString(kev, s, sizeof(search.query) - search.nquery, NULL, NULL) == 1 &&
+	           isprint((unsigned char)*s)) {
+		search.nquery++;
+		matchleaves(1);
+	} else {
+		return 0;
+	}
+	return 1;
 }
 
+/* swap timers at positions i and j of the heap */
 static void
-setfont(const char *facename, double facesize)
+swaptimers(int i, int j)
 {
-	CtrlFontSet *fontset;
+	int timer;
 
-	if (facename == NULL)
-		facename = "xft:";
-	fontset = ctrlfnt_open(
-		pie.display,
-		pie.screen,
-		pie.visual,
-		pie.colormap,
-		facename,
-		facesize
-	);
-	if (fontset == NULL)
-		return;
-	pie.fontset = fontset;
-	pie.fonth = ctrlfnt_height(fontset);
+	timer = timers.heap[i];
+	timers.heap[i] = timers.heap[j];
+	timers.heap[j] = timer;
+	timers.pos[timers.heap[i]] = i + 1;
+	timers.pos[timers.heap[j]] = j + 1;
 }
 
-static XrmDatabase
-loadxdb(const char *str)
+/* move timer at position i of the heap up or down until the heap is in order */
+static void
+sifttimer(int i)
 {
-	return XrmGetStringDatabase(str);
+	int child;
+
+	while (i > 0 && timers.when[timers.heap[i]] < timers.when[timers.heap[(i - 1) / 2]]) {
+		swaptimers(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < timers.n) {
+		if (child + 1 < timers.n &&
+		    timers.when[timers.heap[child + 1]] < timers.when[timers.heap[child]])
+			child++;
+		if (timers.when[timers.heap[i]] <= timers.when[timers.heap[child]])
+			break;
+		swaptimers(i, child);
+		i = child;
+	}
 }
 
+/* start timer to fire after ms milliseconds, restarting it if it is running */
 static void
-loadresources(const char *str)
+settimer(enum Timer timer, long long ms)
 {
+	timers.when[timer] = getmicro() + ms * 1000;
+	if (timers.pos[timer] == 0) {
+		timers.heap[timers.n] = timer;
+		timers.pos[timer] = ++timers.n;
+	}
+	sifttimer(timers.pos[timer] - 1);
+}
 
-	XrmDatabase xdb = NULL;
-	char *value;
-	enum Resource resource;
-	char *endp;
-	char *fontname = NULL;
-	long l;
-	double d, d0, d1;
-	double fontsize = 0.0;
-	int changefont = false;
+/* stop timer, if it is running */
+static void
+stoptimer(enum Timer timer)
+{
+	int i;
+
+	if ((i = timers.pos[timer] - 1) < 0)
+		return;
+	timers.pos[timer] = 0;
+	if (i != --timers.n) {
+		timers.heap[i] = timers.heap[timers.n];
+		timers.pos[timers.heap[i]] = i + 1;
+		sifttimer(i);
+	}
+}
+
+/* get poll timeout in milliseconds until the earliest timer fires, or -1 if none is running */
+static int
+gettimeout(void)
+{
+	long long us;
+
+	if (timers.n == 0)
+		return -1;
+	us = timers.when[timers.heap[0]] - getmicro();
+	if (us <= 0)
+		return 0;
+	return MIN((us + 999) / 1000, INT_MAX);
+}
+
+/* stop and return the earliest timer if it is due, or -1 if none is */
+static int
+firetimer(void)
+{
+	int timer;
+
+	if (timers.n == 0 || timers.when[timers.heap[0]] > getmicro())
+		return -1;
+	timer = timers.heap[0];
+	stoptimer(timer);
+	return timer;
+}
+
+/* get current time in seconds, for cache expiry */
+static time_t
+getsecs(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* drop entry from the generator cache; its menu is freed unless in use */
+static void
+uncache(struct GenCache **entryp)
+{
+	struct GenCache *entry = *entryp;
+
+	*entryp = entry->next;
+	entry->menu->cached = 0;
+	if (entry->menu->parent == NULL)
+		cleanmenu(entry->menu);
+	free(entry->cmd);
+	free(entry);
+}
+
+/* start timer to expire the generator cache when its first entry expires */
+static void
+schedcache(void)
+{
+	struct GenCache *entry;
+	time_t expire = 0;
+
+	for (entry = gencache; entry != NULL; entry = entry->next)
+		if (expire == 0 || entry->expire < expire)
+			expire = entry->expire;
+	if (expire == 0)
+		stoptimer(TIMER_CACHE);
+	else
+		settimer(TIMER_CACHE, (expire - getsecs()) * 1000LL);
+}
+
+/* drop expired entries from the generator cache */
+static void
+expirecache(void)
+{
+	struct GenCache **entryp;
+	time_t now;
+
+	now = getsecs();
+	for (entryp = &gencache; *entryp != NULL; ) {
+		if (flushcache || (*entryp)->expire <= now) {
+			uncache(entryp);
+		} else {
+			entryp = &(*entryp)->next;
+		}
+	}
+	flushcache = 0;
+	schedcache();
+}
+
+/* add menu generated by cmd into the generator cache */
+static void
+addcache(const char *cmd, struct Menu *menu, int ttl)
+{
+	struct GenCache *entry;
+
+	if (ttl <= 0)
+		return;
+	expirecache();
+	for (entry = gencache; entry != NULL; entry = entry->next)
+		if (strcmp(entry->cmd, cmd) == 0)
+			return;
+	entry = emalloc(sizeof(*entry));
+	entry->cmd = estrdup(cmd);
+	entry->menu = menu;
+	entry->expire = getsecs() + ttl;
+	entry->next = gencache;
+	gencache = entry;
+	menu->cached = 1;
+	schedcache();
+}
+
+/* find unexpired entry of the generator cache for cmd */
+static struct GenCache *
+findcache(const char *cmd)
+{
+	struct GenCache *entry;
+
+	expirecache();
+	for (entry = gencache; entry != NULL; entry = entry->next)
+		if (strcmp(entry->cmd, cmd) == 0)
+			return entry;
+	return NULL;
+}
+
+/* set level of menu and its submenus */
+static void
+setlevel(struct Menu *menu, int level)
+{
+	unsigned n;
+
+	menu->level = level;
+	for (n = 0; n < menu->nslices; n++) {
+		if (menu->slices[n].submenu != NULL) {
+			setlevel(menu->slices[n].submenu, level + 1);
+		}
+	}
+}
+
+/* get menu generated by the command of slice from the cache and attach it to the slice */
+static struct Menu *
+getcache(struct Menu *menu, int n)
+{
+	struct GenCache *entry;
+	struct Menu *submenu;
+	struct Menu *holder;
+
+	if ((entry = findcache(menu->slices[n].output)) == NULL)
+		return NULL;
+	submenu = entry->menu;
+
+	/* a menu cannot be its own descendant */
+	if (isvisible(submenu, menu))
+		return NULL;
+
+	/* detach the menu from the slice that was sharing it */
+	if ((holder = submenu->parent) != NULL) {
+		holder->slices[submenu->caller].submenu = NULL;
+		holder->slices[submenu->caller].iscmd = CMD_NOTRUN;
+	}
+
+	submenu->parent = menu;
+	submenu->caller = n;
+	submenu->selected = NOSLICE;
+	setlevel(submenu, menu->level + 1);
+	menu->slices[n].submenu = submenu;
+	menu->slices[n].iscmd = CMD_RUN;
+	return submenu;
+}
+
+/* free the generator cache */
+static void
+cleancache(void)
+{
+	while (gencache != NULL) {
+		gencache->menu->parent = NULL;
+		uncache(&gencache);
+	}
+}
+
+/* clear menus generated via genmenu; cached ones are kept for later */
+static void
+cleangenmenu(struct Menu *menu)
+{
+	struct Slice *slice;
+	unsigned n;
+
+	menu->prefetchn = 0;
+	for (n = 0; n < menu->nslices; n++) {
+		slice = &menu->slices[n];
+		if (slice->submenu != NULL)
+			cleangenmenu(slice->submenu);
+		if (slice->iscmd == CMD_RUN) {
+			if (slice->submenu->cached)
+				slice->submenu->parent = NULL;
+			else
+				cleanmenu(slice->submenu);
+			slice->iscmd = CMD_NOTRUN;
+			slice->submenu = NULL;
+		}
+	}
+}
+
+/* run command of slice to generate a submenu; the submenu is filled as the command outputs */
+static struct Menu *
+genmenu(struct Generator *gen, struct Menu *menu, int n)
+{
+	struct Slice *slice;
+	struct Menu *submenu;
+	pid_t pid;
+	int fd[2];
+
+	slice = &menu->slices[n];
+	if (pipe(fd) == -1) {
+		warn("pipe");
+		return NULL;
+	}
+	if ((pid = efork()) == 0) {
+		(void)setpgid(0, 0);
+		close(fd[0]);
+		if (fd[1] != STDOUT_FILENO) {
+			(void)dup2(fd[1], STDOUT_FILENO);
+			close(fd[1]);
+		}
+		eexecsh(slice->output);
+		exit(1);
+	}
+	(void)setpgid(pid, pid);
+	close(fd[1]);
+	(void)fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+
+	/* show a placeholder until the command outputs something */
+	submenu = allocmenu(menu, menu->level + 1);
+	submenu->caller = n;
+	(void)addslice(submenu, GENLABEL, NULL, NULL);
+	setslices(submenu);
+	slice->submenu = submenu;
+	slice->iscmd = CMD_RUNNING;
+
+	gen->pid = pid;
+	gen->fd = fd[0];
+	gen->menu = menu;
+	gen->slicen = n;
+	gen->submenu = submenu;
+	gen->parser = (struct Parser){
+		.rootmenu = submenu,
+		.prevmenu = submenu,
+		.initlevel = submenu->level,
+	};
+	gen->nitems = 0;
+	gen->ttl = genttl;
+	gen->speculative = 0;
+	if (gentimelimit > 0)
+		settimer(TIMER_GENERATOR + (gen - generators), gentimelimit * 1000LL);
+	gen->len = 0;
+	return submenu;
+}
+
+/* reap the stopped commands that exited; kill the terminated ones still running past their time, or now if force is set */
+static void
+reapzombies(int force)
+{
+	long long now;
+	int i;
+
+	now = getmicro();
+	for (i = 0; i < nzombies; ) {
+		if (waitpid(zombies[i].pid, NULL, WNOHANG) != 0) {
+			zombies[i] = zombies[--nzombies];
+			continue;
+		}
+		if (zombies[i].killtime != 0 && (force || now >= zombies[i].killtime)) {
+			(void)kill(-zombies[i].pid, SIGKILL);
+			zombies[i].killtime = 0;
+		}
+		i++;
+	}
+	if (nzombies > 0 && !force)
+		settimer(TIMER_REAP, REAPTIME);
+}
+
+/* close output of generator and reap its command, terminating it first if term is set */
+/* a command that does not exit at once is reaped later, so the menus do not freeze */
+static void
+reapgen(struct Generator *gen, int term)
+{
+	if (gen->pid != -1) {
+		if (term)
+			(void)kill(-gen->pid, SIGTERM);
+		if (waitpid(gen->pid, NULL, WNOHANG) != 0) {
+			/* reaped already */
+		} else if (nzombies < MAXZOMBS) {
+			zombies[nzombies].pid = gen->pid;
+			zombies[nzombies].killtime = term ? getmicro() + KILLTIME * 1000LL : 0;
+			nzombies++;
+			settimer(TIMER_REAP, REAPTIME);
+		} else {
+			(void)kill(-gen->pid, SIGKILL);
+			(void)waitpid(gen->pid, NULL, 0);
+		}
+	}
+	if (gen->fd != -1)
+		close(gen->fd);
+	gen->pid = -1;
+	gen->fd = -1;
+	stoptimer(TIMER_GENERATOR + (gen - generators));
+}
+
+/* stop generator, if running, discarding the menu it was generating */
+static void
+stopgen(struct Generator *gen)
+{
+	struct Slice *slice;
+	int i;
+
+	if (gen->submenu == NULL)
+		return;
+
+	/* stop generators running in the menu to be discarded first */
+	for (i = 0; i < MAXGENS; i++)
+		if (&generators[i] != gen && generators[i].submenu != NULL &&
+		    isvisible(gen->submenu, generators[i].menu))
+			stopgen(&generators[i]);
+
+	reapgen(gen, 1);
+	slice = &gen->menu->slices[gen->slicen];
+	cleanmenu(slice->submenu);
+	slice->submenu = NULL;
+	slice->iscmd = CMD_NOTRUN;
+	gen->submenu = NULL;
+}
+
+/* stop all generators */
+static void
+stopgens(void)
+{
+	int i;
+
+	for (i = 0; i < MAXGENS; i++) {
+		stopgen(&generators[i]);
+	}
+}
+
+/* get an idle generator; if none is idle and replace is set, stop a prefetch to get its generator */
+static struct Generator *
+getgen(int replace)
+{
+	struct Menu *menu;
+	int i;
+
+	for (i = 0; i < MAXGENS; i++)
+		if (generators[i].submenu == NULL)
+			return &generators[i];
+	if (!replace)
+		return NULL;
+	for (i = 0; i < MAXGENS; i++) {
+		if (generators[i].speculative) {
+			/* its slice is prefetched again when a generator is idle */
+			menu = generators[i].menu;
+			if (menu->prefetchn > (unsigned)generators[i].slicen)
+				menu->prefetchn = generators[i].slicen;
+			stopgen(&generators[i]);
+			return &generators[i];
+		}
+	}
+	return NULL;
+}
+
+/* speculatively run command of slice, replacing another prefetch if replace is set */
+static void
+prefetch(struct Menu *menu, int n, int replace)
+{
+	struct Generator *gen;
+	struct Slice *slice;
+
+	slice = &menu->slices[n];
+	if (slice->iscmd != CMD_NOTRUN || slice->submenu != NULL)
+		return;
+	if (findcache(slice->output) != NULL)
+		return;
+	if ((gen = getgen(replace)) == NULL)
+		return;
+	if (genmenu(gen, menu, n) != NULL) {
+		gen->speculative = 1;
+	}
+}
+
+/* prefetch the next generated menus of menu while there are idle generators */
+static void
+prefetchnext(struct Menu *menu)
+{
+	unsigned n;
+
+	while (getgen(0) != NULL && menu->prefetchn < menu->nslices) {
+		n = menu->prefetchn++;
+		prefetch(menu, n, 0);
+	}
+}
+
+/* discard prefetched menus that were not opened before the menu of their slice was left */
+static void
+dropprefetches(struct Menu *currmenu)
+{
+	struct Slice *slice;
+	struct Menu *menu;
+	int i;
+
+	for (i = 0; i < nprefetched; ) {
+		menu = prefetched[i];
+		if (menu->parent == NULL || isvisible(menu, currmenu)) {
+			/* detached into the cache, or opened */
+			forgetprefetch(menu);
+		} else if (!isvisible(menu->parent, currmenu)) {
+			forgetprefetch(menu);
+			slice = &menu->parent->slices[menu->caller];
+			slice->submenu = NULL;
+			slice->iscmd = CMD_NOTRUN;
+			if (menu->cached)
+				menu->parent = NULL;
+			else
+				cleanmenu(menu);
+		} else {
+			i++;
+		}
+	}
+}
+
+/* add line output by generator into the generated menu */
+static void
+addgenitem(struct Generator *gen, char *line)
+{
+	struct Menu *submenu = gen->submenu;
+	char *endp;
+	long l;
+
+	/* the generator may set how long its menu is cached */
+	if (strncmp(line, GENCACHE, sizeof(GENCACHE) - 1) == 0) {
+		l = strtol(line + sizeof(GENCACHE) - 1, &endp, 10);
+		if (endp != line + sizeof(GENCACHE) - 1 && *endp == '\0' &&
+		    l >= 0 && l <= INT_MAX) {
+			gen->ttl = l;
+			return;
+		}
+	}
+	if (gen->nitems == 0) {
+		/* replace the placeholder */
+		cleanslice(&submenu->slices[0]);
+		submenu->nslices = 0;
+		submenu->selected = NOSLICE;
+	}
+	if (parseline(&gen->parser, line) == RETURN_SUCCESS) {
+		gen->nitems++;
+	} else if (gen->nitems == 0) {
+		/* keep the placeholder until an item is added */
+		(void)addslice(submenu, GENLABEL, NULL, NULL);
+		setmenu(submenu);
+	}
+}
+
+/* read available output of generator into the generated menu; stop it if it timed out */
+static int
+readgen(struct Generator *gen, int timedout)
+{
+	struct Slice *slice;
+	ssize_t nread;
+	char *line, *end;
+	int nitems = gen->nitems;
+	int eof = 0;
+
+	for (;;) {
+		nread = read(
+			gen->fd,
+			gen->buf + gen->len,
+			sizeof(gen->buf) - gen->len - 1
+		);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (nread <= 0) {
+			eof = 1;
+			break;
+		}
+		gen->len += nread;
+		gen->buf[gen->len] = '\0';
+		for (line = gen->buf; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+			*end = '\0';
+			addgenitem(gen, line);
+		}
+		gen->len -= line - gen->buf;
+		memmove(gen->buf, line, gen->len);
+		if (gen->len == sizeof(gen->buf) - 1) {
+			/* line too long, break it */
+			addgenitem(gen, gen->buf);
+			gen->len = 0;
+		}
+	}
+	if (!eof && timedout) {
+		/* the command took too long; keep what it output, but do not cache it */
+		warnx("%s: timed out", gen->menu->slices[gen->slicen].output);
+		gen->ttl = 0;
+		eof = 1;
+	} else {
+		timedout = 0;
+	}
+	if (eof) {
+		if (gen->len > 0) {
+			gen->buf[gen->len] = '\0';
+			addgenitem(gen, gen->buf);
+			gen->len = 0;
+		}
+		reapgen(gen, timedout);
+		if (gen->nitems == 0)
+			return GEN_EMPTY;
+	}
+	if (gen->nitems != nitems) {
+		setslices(gen->submenu);
+	}
+	if (eof) {
+		slice = &gen->menu->slices[gen->slicen];
+		slice->iscmd = CMD_RUN;
+		addcache(slice->output, gen->submenu, gen->ttl);
+		if (gen->speculative && nprefetched < MAXPREFS)
+			prefetched[nprefetched++] = gen->submenu;
+		gen->submenu = NULL;
+		gen->speculative = 0;
+		return GEN_UPDATED;
+	}
+	return (gen->nitems != nitems) ? GEN_UPDATED : GEN_NONE;
+}
+
+/* ungrab pointer and keyboard */
+static void
+ungrab(void)
+{
+	XUngrabPointer(pie.display, CurrentTime);
+	XUngrabKeyboard(pie.display, CurrentTime);
+}
+
+/* map tooltip of the selected slice of menu */
+static void
+showtooltip(struct Menu *menu, XRectangle *monitor)
+{
+	struct Slice *slice;
+
+	if (menu == NULL || menu->selected == NOSLICE)
+		return;
+	slice = &menu->slices[menu->selected];
+	if (!slice->ttdrawn)
+		drawtooltip(slice);
+	maptooltip(slice, monitor, &tooltip.pos);
+	tooltip.menu = menu;
+	tooltip.slicen = menu->selected;
+}
+
+/* unmap tooltip, if mapped */
+static void
+hidetooltip(void)
+{
+	if (tooltip.menu == NULL)
+		return;
+	unmaptooltip(&tooltip.menu->slices[tooltip.slicen]);
+	tooltip.menu = NULL;
+}
+
+/* item was entered, print its output or run it; the daemon sends it to the client */
+static void
+enteritem(const char *output)
+{
+	pid_t pid;
+
+	if (clientfd != -1) {
+		(void)dprintf(clientfd, "%s\n", output);
+	} else if (execcommand) {
+		if ((pid = efork()) == 0) {
+			if (efork() == 0) {
+				eexecsh(output);
+				exit(1);
+			}
+			exit(1);
+		}
+		(void)waitpid(pid, NULL, 0);
+	} else {
+		printf("%s\n", output);
+		fflush(stdout);
+	}
+}
+
+static void
+warppointer(struct Menu *currmenu)
+{
+	XWarpPointer(
+		pie.display,
+		None,
+		currmenu->win,
+		0, 0, 0, 0,
+		pie.radius + pie.border,
+		pie.radius + pie.border
+	);
+}
+
+/* get histogram bucket of given latency in microseconds */
+static int
+getbucket(long long us)
+{
+	int e;
+
+	if (us < 4)
+		return (us < 0) ? 0 : us;
+	for (e = 2; (us >> (e + 1)) != 0; e++)
+		;
+	return MIN(4 * (e - 1) + ((us >> (e - 2)) & 3), NBUCKETS - 1);
+}
+
+/* get lowest latency in microseconds that falls in given histogram bucket */
+static long long
+getbucketvalue(int i)
+{
+	if (i < 4)
+		return i;
+	return (long long)(4 + i % 4) << (i / 4 - 1);
+}
+
+/* save receipt time of event, to be timed after its requests are flushed */
+static void
+starttiming(XEvent *ev)
+{
+	Time time;
+	int32_t delay;
+	long long receipt;
+
+	if (!statsflag || latency.npending == MAXPENDING)
+		return;
+	receipt = getmicro();
+	switch (ev->type) {
+	case KeyPress:
+	case KeyRelease:        time = ev->xkey.time;           break;
+	case ButtonPress:
+	case ButtonRelease:     time = ev->xbutton.time;        break;
+	case MotionNotify:      time = ev->xmotion.time;        break;
+	case EnterNotify:
+	case LeaveNotify:       time = ev->xcrossing.time;      break;
+	default:                time = CurrentTime;             break;
+	}
+	latency.pending[latency.npending].type = ev->type;
+	latency.pending[latency.npending].receipt = receipt;
+	latency.pending[latency.npending].hastime = (time != CurrentTime);
+	if (time != CurrentTime) {
+		/*
+		 * The server clock is unrelated to ours; take the
+		 * smallest difference seen as the transport delay of
+		 * an event that was read as soon as it was sent.
+		 */
+		delay = (int32_t)((uint32_t)(receipt / 1000) - (uint32_t)time);
+		if (!latency.hasdelay || delay < latency.mindelay)
+			latency.mindelay = delay;
+		latency.hasdelay = 1;
+		latency.pending[latency.npending].delay = delay;
+	}
+	latency.npending++;
+}
+
+/* add latencies of events whose requests have been flushed */
+static void
+endtiming(void)
+{
+	unsigned long long written, nbytes;
+	long long end, us;
+	int i, type;
+
+	if (!statsflag)
+		return;
+
+	/* count the bytes sent for the events, as the requests have just been flushed */
+	written = xcb_total_written(pie.conn);
+	nbytes = written - stats.written;
+	stats.written = written;
+	if (latency.npending == 0)
+		return;
+	stats.ninteractions++;
+	stats.nbytes += nbytes;
+	stats.maxbytes = MAX(stats.maxbytes, nbytes);
+	if (latency.syncflag)
+		XSync(pie.display, False);
+	end = getmicro();
+	for (i = 0; i < latency.npending; i++) {
+		type = latency.pending[i].type;
+		us = end - latency.pending[i].receipt;
+		latency.hist[type][LATENCY_RECEIPT][getbucket(us)]++;
+		if (!latency.pending[i].hastime)
+			continue;
+		us += (long long)(latency.pending[i].delay - latency.mindelay) * 1000;
+		latency.hist[type][LATENCY_SERVER][getbucket(us)]++;
+	}
+	latency.npending = 0;
+}
+
+static void
+sigusr1(int sig)
+{
+	(void)sig;
+	dumpstats = 1;
+}
+
+static void
+sighup(int sig)
+{
+	(void)sig;
+	flushcache = 1;
+}
+
+/* drop queued motion events on the same window, keeping the latest one */
+static void
+coalescemotion(XEvent *ev)
+{
+	XEvent next;
+
+	while (XEventsQueued(pie.display, QueuedAfterReading) > 0) {
+		XPeekEvent(pie.display, &next);
+		if (next.type != MotionNotify ||
+		    next.xmotion.window != ev->xmotion.window)
+			break;
+		XNextEvent(pie.display, ev);
+		stats.ncoalesced++;
+	}
+}
+
+static void printstats(void);
+static void printprofile(void);
+
+/* flush requests of all handled events and wait for the next one */
+/* the first file descriptor must be the X connection */
+static int
+waitevent(struct pollfd *pfds, nfds_t nfds, int timeout)
+{
+	int nready;
+	int queued;
+	int error;
+
+	if ((queued = XEventsQueued(pie.display, QueuedAfterReading)) > 0) {
+		/* events are queued already, just check the other files */
+		timeout = 0;
+	} else {
+		XFlush(pie.display);
+		stats.nflushes++;
+		endtiming();
+	}
+	/* signals may also arrive outside poll(), check for them after it returns */
+	for (;;) {
+		nready = poll(pfds, nfds, timeout);
+		error = errno;
+		if (dumpstats) {
+			dumpstats = 0;
+			if (statsflag)
+				printstats();
+			if (profileflag)
+				printprofile();
+		}
+		if (flushcache) {
+			expirecache();
+		}
+		if (nready != -1 || error != EINTR)
+			break;
+	}
+	errno = error;
+	if (nready != -1 && queued) {
+		if (pfds[0].revents == 0)
+			nready++;
+		pfds[0].revents |= POLLIN;
+	}
+	return nready;
+}
+
+/* follow gesture from origin to pointer position (x, y); return the menu it has reached */
+static struct Menu *
+markmenu(struct Menu *menu, XPoint *origin, int x, int y)
+{
+	struct Menu *submenu;
+	int dx, dy;
+	int n;
+
+	/* the gesture must be as long as the radius of the pie to select a slice */
+	dx = x - origin->x;
+	dy = origin->y - y;
+	if (dx * dx + dy * dy < pie.radius * pie.radius) {
+		menu->selected = NOSLICE;
+		return menu;
+	}
+	n = slicenat(menu->nslices, dx, dy) - 1;
+	menu->selected = n;
+	if ((submenu = menu->slices[n].submenu) == NULL)
+		return menu;
+
+	/* the gesture goes on from here into the submenu */
+	origin->x = x;
+	origin->y = y;
+	submenu->selected = NOSLICE;
+	return submenu;
+}
+
+/* stop following a gesture and show the menus it went through */
+static struct Menu *
+showmarked(struct Menu *currmenu, XRectangle *monitor)
+{
+	stoptimer(TIMER_MARK);
+	XChangeActivePointerGrab(pie.display, ButtonPressMask, None, CurrentTime);
+	(void)mapmenu(currmenu, NULL, monitor);
+	copymenu(currmenu);
+	if (!nowarpflag)
+		warppointer(currmenu);
+	return currmenu;
+}
+
+static void
+run(struct pollfd *pfd, struct Menu *rootmenu, XRectangle *monitor, XPoint *pointer)
+{
+	struct Menu *currmenu;
+	struct Menu *prevmenu;
+	struct Menu *menu = NULL;
+	struct Menu *submenu;
+	struct Slice *slice = NULL;
+	struct Generator *gen;
+	struct pollfd pfds[1 + MAXGENS];
+	KeySym ksym;
+	int i, n;
+	XEvent ev;
+	int timedout[MAXGENS];
+	int timer;
+	int nready;
+	struct Menu *typedmenu = NULL;
+	char typed[MAXTYPED];
+	size_t ntyped = 0;
+	XPoint origin;
+	int marking;
+	int lazy = 1;
+
+	if (rootmenu == NULL)
+		return;
+	pfds[0] = *pfd;
+	for (i = 0; i < MAXGENS; i++)
+		pfds[i + 1].events = POLLIN;
+	prevmenu = currmenu = rootmenu;
+	if ((marking = markingflag)) {
+		/* nothing is shown until the gesture stops */
+		prevmenu = NULL;
+		origin = *pointer;
+		XChangeActivePointerGrab(
+			pie.display,
+			ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+			None,
+			CurrentTime
+		);
+		settimer(TIMER_MARK, MARKTIME);
+	}
+	for (;;) {
+		if (prefetchflag == PREFETCH_MAP && currmenu != NULL)
+			prefetchnext(currmenu);
+		for (i = 0; i < MAXGENS; i++)
+			pfds[i + 1].fd = generators[i].fd;
+		if ((nready = waitevent(pfds, LEN(pfds), lazy ? 0 : gettimeout())) == -1)
+			break;
+
+		/* nothing to handle; set up another submenu */
+		if (nready == 0 && lazy)
+			lazy = setupnext(rootmenu);
+
+		/* fire due timers */
+		memset(timedout, 0, sizeof(timedout));
+		while ((timer = firetimer()) != -1) {
+			switch (timer) {
+			case TIMER_TOOLTIP:
+				showtooltip(currmenu, monitor);
+				break;
+			case TIMER_PREFETCH:
+				if (currmenu != NULL && currmenu->selected != NOSLICE)
+					prefetch(currmenu, currmenu->selected, 1);
+				break;
+			case TIMER_CACHE:
+				expirecache();
+				break;
+			case TIMER_STAT:
+				/* the menu file is reloaded only when the menu is closed */
+				settimer(TIMER_STAT, STATTIME);
+				break;
+			case TIMER_REAP:
+				reapzombies(0);
+				break;
+			case TIMER_MARK:
+				marking = 0;
+				prevmenu = showmarked(currmenu, monitor);
+				break;
+			default:
+				timedout[timer - TIMER_GENERATOR] = 1;
+				break;
+			}
+		}
+
+		/* read generators' output */
+		for (i = 0; i < MAXGENS; i++) {
+			gen = &generators[i];
+			if (gen->submenu == NULL)
+				continue;
+			if (pfds[i + 1].revents == 0 && !timedout[i])
+				continue;
+			if (tooltip.menu != NULL && isvisible(gen->submenu, tooltip.menu))
+				hidetooltip();
+			switch (readgen(gen, timedout[i])) {
+			case GEN_EMPTY:
+				/* generator output nothing, close its menu */
+				if (currmenu == gen->submenu) {
+					currmenu = currmenu->parent;
+					if (!marking) {
+						prevmenu = mapmenu(currmenu, prevmenu, monitor);
+					}
+				}
+				stopgen(gen);
+				/* FALLTHROUGH */
+			case GEN_UPDATED:
+				copymenu(currmenu);
+				break;
+			}
+		}
+		if (pfds[0].revents == 0)
+			continue;
+		XNextEvent(pie.display, &ev);
+		stats.nevents++;
+		starttiming(&ev);
+
+		/* any event but motion within the selected slice hides the tooltip */
+		if (ev.type != MotionNotify)
+			hidetooltip();
+
+		switch (ev.type) {
+		case MotionNotify:
+			stats.nmotions++;
+			coalescemotion(&ev);
+			if (marking) {
+				currmenu = markmenu(currmenu, &origin, ev.xmotion.x_root, ev.xmotion.y_root);
+				settimer(TIMER_MARK, MARKTIME);
+				break;
+			}
+			menu = getmenu(currmenu, ev.xmotion.window);
+			n = getslice(menu, ev.xmotion.x, ev.xmotion.y);
+			if (menu == NULL) {
+				stoptimer(TIMER_TOOLTIP);
+				stoptimer(TIMER_PREFETCH);
+				break;
+			}
+			if (menu->selected == n &&
+			    (menu == currmenu || nowarpflag)) {
+				/* motion within the selected slice */
+				if (menu == currmenu && tooltip.menu == NULL) {
+					settimer(TIMER_TOOLTIP, TTDELAY);
+					tooltip.pos.x = ev.xmotion.x_root;
+					tooltip.pos.y = ev.xmotion.y_root;
+				}
+				stats.nunchanged++;
+				break;
+			}
+			stoptimer(TIMER_TOOLTIP);
+			stoptimer(TIMER_PREFETCH);
+			if (nowarpflag) {
+				menu->selected = n;
+			} else if (currmenu != rootmenu && menu != currmenu) {
+				/* motion off a non-root menu */
+				currmenu = currmenu->parent;
+				prevmenu = mapmenu(currmenu, prevmenu, monitor);
+				currmenu->selected = NOSLICE;
+				copymenu(currmenu);
+			}
+			if (menu == currmenu) {
+				/* motion inside a menu */
+				currmenu->selected = n;
+				settimer(TIMER_TOOLTIP, TTDELAY);
+				if (prefetchflag != PREFETCH_NONE && n != NOSLICE &&
+				    currmenu->slices[n].iscmd == CMD_NOTRUN)
+					settimer(TIMER_PREFETCH, PFDELAY);
+				tooltip.pos.x = ev.xmotion.x_root;
+				tooltip.pos.y = ev.xmotion.y_root;
+			}
+			copymenu(currmenu);
+			break;
+		case ButtonRelease:
+			stoptimer(TIMER_TOOLTIP);
+			stoptimer(TIMER_PREFETCH);
+			if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3)
+				break;
+			if (marking) {
+				/* the gesture ends on an item */
+				n = currmenu->selected;
+				slice = (n != NOSLICE) ? &currmenu->slices[n] : NULL;
+				if (slice != NULL && slice->iscmd == NO_CMD && slice->output != NULL) {
+					enteritem(slice->output);
+					goto done;
+				}
+
+				/* the gesture was not complete, show where it stopped */
+				marking = 0;
+				prevmenu = showmarked(currmenu, monitor);
+				if (slice == NULL || slice->iscmd != CMD_NOTRUN)
+					break;
+				menu = currmenu;
+				goto selectslice;
+			}
+			menu = getmenu(currmenu, ev.xbutton.window);
+			n = getslice(menu, ev.xbutton.x, ev.xbutton.y);
+			if (menu == NULL || n == NOSLICE)
+				break;
+selectslice:
+			slice = &menu->slices[n];
+			if (slice->submenu) {
+				currmenu = slice->submenu;
+			} else if (slice->iscmd == CMD_NOTRUN) {
+				submenu = getcache(menu, n);
+				if (submenu == NULL && (gen = getgen(1)) != NULL)
+					submenu = genmenu(gen, menu, n);
+				if (submenu != NULL) {
+					currmenu = submenu;
+				}
+			} else if (slice->output == NULL) {
+				/* placeholder of a menu being generated */
+				break;
+			} else {
+				enteritem(slice->output);
+				goto done;
+			}
+			prevmenu = mapmenu(currmenu, prevmenu, monitor);
+			currmenu->selected = NOSLICE;
+			copymenu(currmenu);
+			if (!nowarpflag)
+				warppointer(currmenu);
+			break;
+		case LeaveNotify:
+			if (!(ev.xcrossing.state & (Button1Mask | Button3Mask)))
+				break;
+			menu = getmenu(currmenu, ev.xcrossing.window);
+			n = getslice(menu, ev.xcrossing.x, ev.xcrossing.y);
+			if (menu == NULL || n == NOSLICE)
+				break;
+			if (menu == currmenu && n == currmenu->selected &&
+			    (menu->slices[n].submenu != NULL ||
+			     menu->slices[n].iscmd == CMD_NOTRUN))
+				goto selectslice;
+			break;
+		case ButtonPress:
+			stoptimer(TIMER_TOOLTIP);
+			stoptimer(TIMER_PREFETCH);
+			if (marking)
+				break;
+			if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3)
+				break;
+			menu = getmenu(currmenu, ev.xbutton.window);
+			n = getslice(menu, ev.xbutton.x, ev.xbutton.y);
+			if (menu == NULL || n == NOSLICE)
+				goto done;
+			break;
+		case KeyPress:
+			stoptimer(TIMER_TOOLTIP);
+			stoptimer(TIMER_PREFETCH);
+			ksym = XkbKeycodeToKeysym(pie.display, ev.xkey.keycode, 0, 0);
+
+			/* esc cancels a gesture; other keys show where it stopped */
+			if (marking && ksym == XK_Escape)
+				goto done;
+			if (marking) {
+				marking = 0;
+				prevmenu = showmarked(currmenu, monitor);
+			}
+
+			/* keys typed into the search menu change the query */
+			if (currmenu == search.menu && typesearch(&ev.xkey, ksym)) {
+				showmatches();
+				copymenu(currmenu);
+				break;
+			}
+
+			/* control-f searches the whole menu tree */
+			if (ksym == XK_f && (ev.xkey.state & ControlMask) && currmenu != search.menu) {
+				currmenu = startsearch(currmenu);
+				prevmenu = mapmenu(currmenu, prevmenu, monitor);
+				copymenu(currmenu);
+				if (!nowarpflag)
+					warppointer(currmenu);
+				break;
+			}
+
+			/* esc closes pmenu when current menu is the root menu */
+			if (ksym == XK_Escape && currmenu->parent == NULL)
+				goto done;
+
+			/* Shift-Tab = ISO_Left_Tab */
+			if (ksym == XK_Tab && (ev.xkey.state & ShiftMask))
+				ksym = XK_ISO_Left_Tab;
+
+			/* forget what was typed into another menu */
+			if (currmenu != typedmenu) {
+				typedmenu = currmenu;
+				ntyped = 0;
+			}
+
+			/* cycle through menu */
+			if (ksym == XK_Tab) {
+				ntyped = 0;
+				n = slicecycle(currmenu, 1);
+			} else if (ksym == XK_ISO_Left_Tab) {
+				ntyped = 0;
+				n = slicecycle(currmenu, 0);
+			} else if ((ksym == XK_Return) &&
+			           currmenu->selected != NOSLICE) {
+				n = currmenu->selected;
+				menu = currmenu;
+				goto selectslice;
+			} else if ((ksym == XK_Escape) &&
+			           currmenu->parent != NULL) {
+				n = currmenu->parent->selected;
+				currmenu = currmenu->parent;
+				prevmenu = mapmenu(currmenu, prevmenu, monitor);
+			} else if (ksym == XK_BackSpace && ntyped > 0) {
+				/* select by what remains typed */
+				if (--ntyped == 0)
+					break;
+				n = findlabel(currmenu, typed, ntyped);
+			} else if (XLookupString(&ev.xkey, typed + ntyped, sizeof(typed) - ntyped, NULL, NULL) == 1 &&
+			           isprint((unsigned char)typed[ntyped])) {
+				/* select the first slice whose label begins with what was typed */
+				if ((n = findlabel(currmenu, typed, ntyped + 1)) == NOSLICE)
+					break;
+				ntyped++;
+			} else
+				break;
+			currmenu->selected = n;
+			copymenu(currmenu);
+			break;
+		case ConfigureNotify:
+			menu = getmenu(currmenu, ev.xconfigure.window);
+			if (menu == NULL) {
+				(void)changemonitors(&ev);
+				break;
+			}
+			menu->x = ev.xconfigure.x;
+			menu->y = ev.xconfigure.y;
+			break;
+		case PropertyNotify:
+			/* resources are loaded again once the menu is closed */
+			if (ev.xproperty.atom == XA_RESOURCE_MANAGER)
+				themechanged = 1;
+			break;
+		default:
+			/* the open menus stay where they are; the new layout is used next time */
+			(void)changemonitors(&ev);
+			break;
+		}
+
+		/* motion off the slice whose tooltip is mapped hides it */
+		if (tooltip.menu != NULL &&
+		    (tooltip.menu != currmenu || currmenu->selected != tooltip.slicen))
+			hidetooltip();
+
+		/* close the search menu once it has been left */
+		if (search.menu != NULL && currmenu != search.menu)
+			endsearch();
+
+		/* cancel generators whose menu has been left */
+		for (i = 0; i < MAXGENS; i++) {
+			gen = &generators[i];
+			if (gen->submenu == NULL) {
+				continue;
+			} else if (isvisible(gen->submenu, currmenu)) {
+				gen->speculative = 0;
+			} else if (!gen->speculative || !isvisible(gen->menu, currmenu)) {
+				stopgen(gen);
+			}
+		}
+		dropprefetches(currmenu);
+	}
+	if (nready == -1)
+		err(1, "poll");
+done:
+	hidetooltip();
+	stoptimer(TIMER_TOOLTIP);
+	stoptimer(TIMER_PREFETCH);
+	stoptimer(TIMER_MARK);
+	unmapmenu(currmenu);
+	endsearch();
+	ungrab();
+	stopgens();
+	cleangenmenu(rootmenu);
+	nprefetched = 0;
+	expirecache();
+}
+
+static char *
+getresource(XrmDatabase xdb, enum Resource resource)
+{
+	XrmQuark name[] = {
+		pie.application.name,
+		pie.resources[resource].name,
+		NULLQUARK,
+	};
+	XrmQuark class[] = {
+		pie.application.class,
+		pie.resources[resource].class,
+		NULLQUARK,
+	};
+	XrmRepresentation tmp;
+	XrmValue xval;
+
+	if (XrmQGetResource(xdb, name, class, &tmp, &xval))
+		return xval.addr;
+	return NULL;
+}
+
+/* get the database of color names, reading it if not read yet */
+static const char *
+getrgbnames(void)
+{
+	FILE *fp;
+	size_t size = 0;
+
+	if (rgbnames.read)
+		return rgbnames.data;
+	rgbnames.read = 1;
+	if ((fp = fopen(RGBFILE, "r")) == NULL)
+		return NULL;
+
+	/* there is no NUL in the file, so it is read up to its end */
+	if (getdelim(&rgbnames.data, &size, '\0', fp) == -1) {
+		free(rgbnames.data);
+		rgbnames.data = NULL;
+	}
+	fclose(fp);
+	return rgbnames.data;
+}
+
+/* forget the database of color names, so it is read again when the resources are reloaded */
+static void
+cleanrgbnames(void)
+{
+	free(rgbnames.data);
+	rgbnames.data = NULL;
+	rgbnames.read = 0;
+}
+
+/* parse colorname into chans without asking the server; return RETURN_FAILURE if it is not known locally */
+static int
+parsecolor(const char *colorname, XRenderColor *chans)
+{
+	static const char *hexdigits = "0123456789abcdefABCDEF";
+	unsigned short comps[3];
+	char line[128];
+	char buf[5];
+	const char *s, *end;
+	size_t len, ndigits;
+	int r, g, b, off;
+	int i;
+
+	if (colorname[0] == '#') {
+		/* "#RGB", "#RRGGBB", and so on; components are shifted, as by XParseColor */
+		len = strlen(colorname + 1);
+		if (len == 0 || len % 3 != 0 || len > 12 || strspn(colorname + 1, hexdigits) != len)
+			return RETURN_FAILURE;
+		ndigits = len / 3;
+		for (i = 0; i < 3; i++) {
+			memcpy(buf, colorname + 1 + i * ndigits, ndigits);
+			buf[ndigits] = '\0';
+			comps[i] = strtoul(buf, NULL, 16) << (16 - 4 * ndigits);
+		}
+	} else if (strncasecmp(colorname, "rgb:", 4) == 0) {
+		/* "rgb:R/G/B", with one to four digits per component; components are scaled */
+		s = colorname + 4;
+		for (i = 0; i < 3; i++) {
+			ndigits = strspn(s, hexdigits);
+			if (ndigits < 1 || ndigits > 4 || s[ndigits] != (i < 2 ? '/' : '\0'))
+				return RETURN_FAILURE;
+			comps[i] = strtoul(s, NULL, 16) * 0xFFFF / ((1UL << (4 * ndigits)) - 1);
+			s += ndigits + 1;
+		}
+	} else {
+		/* color names, from the database the server also reads */
+		if ((s = getrgbnames()) == NULL)
+			return RETURN_FAILURE;
+		for (;; s = end + 1) {
+			/* scan a copy of the line, as sscanf(3) may measure the whole string */
+			end = s + strcspn(s, "\n");
+			len = MIN((size_t)(end - s), sizeof(line) - 1);
+			memcpy(line, s, len);
+			line[len] = '\0';
+			if (sscanf(line, "%d %d %d %n", &r, &g, &b, &off) == 3 &&
+			    strcasecmp(line + off, colorname) == 0)
+				break;
+			if (*end == '\0')
+				return RETURN_FAILURE;
+		}
+		comps[0] = r * 0x101;
+		comps[1] = g * 0x101;
+		comps[2] = b * 0x101;
+	}
+	*chans = (XRenderColor){
+		.red   = comps[0],
+		.green = comps[1],
+		.blue  = comps[2],
+		.alpha = 0xFFFF,
+	};
+	return RETURN_SUCCESS;
+}
+
+static void
+setcolor(int scheme, int colornum, const char *colorname)
+{
+	XColor color;
+
+	if (colorname == NULL)
+		return;
+	if (parsecolor(colorname, &pie.colors[scheme][colornum].chans) == RETURN_SUCCESS)
+		return;
+
+	/* the color may be in a format only the server knows */
+	if (!XParseColor(pie.display, pie.colormap, colorname, &color)) {
+		warnx("%s: unknown color name", colorname);
+		return;
+	}
+	pie.colors[scheme][colornum].chans = (XRenderColor){
+		.red   = FLAG(color.flags, DoRed)   ? color.red   : 0x0000,
+		.green = FLAG(color.flags, DoGreen) ? color.green : 0x0000,
+		.blue  = FLAG(color.flags, DoBlue)  ? color.blue  : 0x0000,
+		.alpha = 0xFFFF,
+	};
+}
+
+static void
+setfont(const char *facename, double facesize)
+{
+	CtrlFontSet *fontset;
+
+	fontset = ctrlfnt_open(
+		pie.display,
+		pie.screen,
+		pie.visual,
+		pie.colormap,
+		(facename != NULL) ? facename : "xft:",
+		facesize
+	);
+	if (fontset == NULL)
+		return;
+	if (pie.fontset != NULL)
+		ctrlfnt_free(pie.fontset);
+	free(pie.facename);
+	pie.facename = (facename != NULL) ? estrdup(facename) : NULL;
+	pie.facesize = facesize;
+	pie.fontset = fontset;
+	pie.fonth = ctrlfnt_height(fontset);
+}
+
+static XrmDatabase
+loadxdb(const char *str)
+{
+	return XrmGetStringDatabase(str);
+}
+
+static void
+loadresources(const char *str)
+{
+
+	XrmDatabase xdb = NULL;
+	char *value;
+	enum Resource resource;
+	char *endp;
+	char *fontname = NULL;
+	long l;
+	double d;
+	double fontsize = 0.0;
+	int changefont = false;
+	int i, j;
 
 	pie.border = DEF_BORDER;
 	if (!harddiameter)
 		pie.diameter = DEF_DIAMETER;
+	pie.colors[SCHEME_NORMAL][COLOR_BG].chans = DEF_COLOR_BG;
+	pie.colors[SCHEME_NORMAL][COLOR_FG].chans = DEF_COLOR_FG;
+	pie.colors[SCHEME_SELECT][COLOR_BG].chans = DEF_COLOR_SELBG;
+	pie.colors[SCHEME_SELECT][COLOR_FG].chans = DEF_COLOR_SELFG;
+	pie.colors[SCHEME_BORDER][COLOR_TOP].chans = DEF_COLOR_BORDER;
+	pie.colors[SCHEME_BORDER][COLOR_BOT].chans = DEF_COLOR_BORDER;
 	if (str == NULL)
 		goto done;
 	if ((xdb = loadxdb(str)) == NULL)
@@ -1802,258 +4217,1064 @@ loadresources(const char *str)
 			break;
 		}
 	}
-	if (changefont)
-		setfont(fontname, fontsize);
-	XrmDestroyDatabase(xdb);
-done:
-	pie.radius = (pie.diameter + 1) / 2;
-	pie.fulldiameter = pie.diameter + (pie.border * 2);
+done:
+	cleanrgbnames();
+
+	/* the font is opened again only if it changed */
+	if (pie.fontset == NULL ? changefont :
+	    (!strsame(fontname, pie.facename) || fontsize != pie.facesize))
+		setfont(fontname, fontsize);
+	if (xdb != NULL)
+		XrmDestroyDatabase(xdb);
+	for (i = 0; i < SCHEME_LAST; i++) {
+		for (j = 0; j < COLOR_LAST; j++) {
+			XRenderFillRectangle(
+				pie.display,
+				PictOpSrc,
+				pie.colors[i][j].pict,
+				&pie.colors[i][j].chans,
+				0, 0, 1, 1
+			);
+		}
+	}
+	pie.radius = (pie.diameter + 1) / 2;
+	pie.fulldiameter = pie.diameter + (pie.border * 2);
+}
+
+/* create gradient picture of the border */
+static void
+setgradient(void)
+{
+	double d, d0, d1;
+
+	if (pie.gradient != None)
+		XRenderFreePicture(pie.display, pie.gradient);
+	d = pie.fulldiameter * pie.fulldiameter * 2;
+	d = sqrt(d);
+	d0 = d - pie.fulldiameter;
+	d0 /= 2;
+	d0 /= d;
+	d1 = d - pie.fulldiameter;
+	d1 /= 2;
+	d1 += pie.fulldiameter;
+	d1 /= d;
+	pie.gradient = XRenderCreateLinearGradient(
+		pie.display,
+		&(XLinearGradient){
+			.p1 = (XPointFixed){
+				.x = XDoubleToFixed(0.0),
+				.y = XDoubleToFixed(0.0),
+			},
+			.p2 = (XPointFixed){
+				.x = XDoubleToFixed((double)pie.fulldiameter),
+				.y = XDoubleToFixed((double)pie.fulldiameter),
+			},
+		},
+		(XFixed[]){
+			[0] = XDoubleToFixed(0.0),
+			[1] = XDoubleToFixed(d0),
+			[2] = XDoubleToFixed(d1),
+			[3] = XDoubleToFixed(1.0),
+		},
+		(XRenderColor[]){
+			[0] = pie.colors[SCHEME_BORDER][COLOR_TOP].chans,
+			[1] = pie.colors[SCHEME_BORDER][COLOR_TOP].chans,
+			[2] = pie.colors[SCHEME_BORDER][COLOR_BOT].chans,
+			[3] = pie.colors[SCHEME_BORDER][COLOR_BOT].chans,
+		},
+		4
+	);
+}
+
+static int
+initxconn(void)
+{
+	static char *atomnames[NATOMS] = {
+#define X(atom) [atom] = #atom,
+		ATOMS
+#undef X
+	};
+	xcb_intern_atom_cookie_t atomcookies[NATOMS];
+	xcb_intern_atom_reply_t *reply;
+	size_t i;
+
+	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+		warnx("could not set locale");
+	if ((pie.display = XOpenDisplay(NULL)) == NULL) {
+		warnx("could not connect to X server");
+		return RETURN_FAILURE;
+	}
+	if (profile.running || statsflag)
+		(void)XSetAfterFunction(pie.display, countroundtrip);
+	pie.conn = XGetXCBConnection(pie.display);
+	pie.screen = XDefaultScreen(pie.display);
+	pie.rootwin = XRootWindow(pie.display, pie.screen);
+
+	/*
+	 * Send the queries needed before the first menu is shown at once,
+	 * so they take a single round trip rather than one each.  Their
+	 * replies are collected when needed.
+	 */
+	xcb_prefetch_extension_data(pie.conn, &xcb_xinerama_id);
+	for (i = 0; i < NATOMS; i++)
+		atomcookies[i] = xcb_intern_atom(pie.conn, 0, strlen(atomnames[i]), atomnames[i]);
+	for (i = 0; i < NATOMS; i++) {
+		if ((reply = getreply(atomcookies[i].sequence)) == NULL) {
+			warnx("could not intern X pie.atoms");
+			return RETURN_FAILURE;
+		}
+		pie.atoms[i] = reply->atom;
+		free(reply);
+	}
+	if (!rootmodeflag && !daemonflag)
+		askmonitors();
+	return RETURN_SUCCESS;
+}
+
+static int
+initvisual(void)
+{
+	XVisualInfo vinfo;
+	Colormap cmap;
+	int success;
+
+	success = XMatchVisualInfo(
+		pie.display,
+		pie.screen,
+		32,             /* preferred depth */
+		TrueColor,
+		&vinfo
+	);
+	cmap = success ? XCreateColormap(
+		pie.display,
+		pie.rootwin,
+		vinfo.visual,
+		AllocNone
+	) : None;
+	if (success && cmap != None) {
+		pie.colormap = cmap;
+		pie.visual = vinfo.visual;
+		pie.depth = vinfo.depth;
+	} else {
+		pie.colormap = XDefaultColormap(pie.display, pie.screen);
+		pie.visual = XDefaultVisual(pie.display, pie.screen);
+		pie.depth = XDefaultDepth(pie.display, pie.screen);
+	}
+	pie.xformat = XRenderFindVisualFormat(pie.display, pie.visual);
+	if (pie.xformat == NULL)
+		goto error;
+	pie.alphaformat = XRenderFindStandardFormat(pie.display, PictStandardA8);
+	if (pie.alphaformat == NULL)
+		goto error;
+	pie.argbformat = XRenderFindStandardFormat(pie.display, PictStandardARGB32);
+	if (pie.argbformat == NULL)
+		goto error;
+	pie.dummy = createwindow(1, 1, 0);
+	if (pie.dummy == None) {
+		warnx("could not find XRender visual format");
+		return RETURN_FAILURE;
+	}
+	return RETURN_SUCCESS;
+error:
+	warnx("could not find XRender visual format");
+	return RETURN_FAILURE;
+}
+
+static int
+initresources(void)
+{
+	static struct {
+		const char *class, *name;
+	} resourceids[NRESOURCES] = {
+#define X(res, s1, s2) [res] = { .class = s1, .name = s2, },
+		RESOURCES
+#undef  X
+	};
+	int i;
+
+	XrmInitialize();
+	pie.application.class = XrmPermStringToQuark(pie.classh.res_class);
+	pie.application.name = XrmPermStringToQuark(pie.classh.res_name);
+	for (i = 0; i < NRESOURCES; i++) {
+		pie.resources[i].class = XrmPermStringToQuark(resourceids[i].class);
+		pie.resources[i].name = XrmPermStringToQuark(resourceids[i].name);
+	}
+	return RETURN_SUCCESS;
+}
+
+static int
+inittheme(void)
+{
+	int i, j;
+
+	for (i = 0; i < SCHEME_LAST; i++) {
+		for (j = 0; j < COLOR_LAST; j++) {
+			pie.colors[i][j].pix = XCreatePixmap(
+				pie.display,
+				pie.dummy,
+				1, 1,
+				pie.depth
+			);
+			if (pie.colors[i][j].pix == None) {
+				warnx("could not create pixmap");
+				return RETURN_FAILURE;
+			}
+			pie.colors[i][j].pict = XRenderCreatePicture(
+				pie.display,
+				pie.colors[i][j].pix,
+				pie.xformat,
+				CPRepeat,
+				&(XRenderPictureAttributes){
+					.repeat = RepeatNormal,
+				}
+			);
+			if (pie.colors[i][j].pict == None) {
+				warnx("could not create pixmap");
+				return RETURN_FAILURE;
+			}
+		}
+	}
+	loadresources(XResourceManagerString(pie.display));
+	if (pie.fontset == NULL)
+		setfont(NULL, 0.0);
+	if (pie.fontset == NULL) {
+		warnx("could not load any font");
+		return RETURN_FAILURE;
+	}
+	setgradient();
+	return RETURN_SUCCESS;
+}
 
-	/* create gradient picture */
-	if (pie.gradient != None)
-		XRenderFreePicture(pie.display, pie.gradient);
-	d = pie.fulldiameter * pie.fulldiameter * 2;
-	d = sqrt(d);
-	d0 = d - pie.fulldiameter;
-	d0 /= 2;
-	d0 /= d;
-	d1 = d - pie.fulldiameter;
-	d1 /= 2;
-	d1 += pie.fulldiameter;
-	d1 /= d;
-	pie.gradient = XRenderCreateLinearGradient(
+static int
+initpie(void)
+{
+	GC gc;
+
+	/* set tooltip geometry */
+	pie.tooltiph = pie.fonth + 2 * TTPAD;
+
+	/* set the geometry of the triangle for submenus */
+	pie.triangleouter = pie.radius - TRIANGLE_DISTANCE;
+	pie.triangleinner = pie.radius - TRIANGLE_DISTANCE - TRIANGLE_WIDTH;
+	pie.triangleangle = ((double)TRIANGLE_HEIGHT / 2.0) / (double)pie.triangleinner;
+
+	/* set the separator beginning and end */
+	pie.separatorbeg = pie.radius * SEPARATOR_BEG;
+	pie.separatorend = pie.radius * SEPARATOR_END;
+	pie.innerangle = atan(1.0 / (2.0 * pie.separatorbeg));
+	pie.outerangle = atan(1.0 / (2.0 * pie.separatorend));
+
+	/* create bitmap mask (depth = 1) */
+	pie.clip = XCreatePixmap(
 		pie.display,
-		&(XLinearGradient){
-			.p1 = (XPointFixed){
-				.x = XDoubleToFixed(0.0),
-				.y = XDoubleToFixed(0.0),
-			},
-			.p2 = (XPointFixed){
-				.x = XDoubleToFixed((double)pie.fulldiameter),
-				.y = XDoubleToFixed((double)pie.fulldiameter),
-			},
-		},
-		(XFixed[]){
-			[0] = XDoubleToFixed(0.0),
-			[1] = XDoubleToFixed(d0),
-			[2] = XDoubleToFixed(d1),
-			[3] = XDoubleToFixed(1.0),
-		},
-		(XRenderColor[]){
-			[0] = pie.colors[SCHEME_BORDER][COLOR_TOP].chans,
-			[1] = pie.colors[SCHEME_BORDER][COLOR_TOP].chans,
-			[2] = pie.colors[SCHEME_BORDER][COLOR_BOT].chans,
-			[3] = pie.colors[SCHEME_BORDER][COLOR_BOT].chans,
-		},
-		4
+		pie.dummy,
+		pie.fulldiameter,
+		pie.fulldiameter,
+		1
+	);
+	if (pie.clip == None) {
+		warnx("could not create bitmap");
+		return RETURN_FAILURE;
+	}
+
+	/* Create the mask GC */
+	gc = XCreateGC(
+		pie.display,
+		pie.clip,
+		GCBackground | GCArcMode,
+		&(XGCValues){
+			.background = 1,
+			.arc_mode = ArcPieSlice,
+		}
 	);
+	if (gc == NULL) {
+		warnx("could not create graphics context");
+		return RETURN_FAILURE;
+	}
+
+	/* clear the bitmap */
+	XSetForeground(pie.display, gc, 0);
+	XFillRectangle(pie.display, pie.clip, gc, 0, 0, pie.fulldiameter, pie.fulldiameter);
+
+	/* create round shape */
+	XSetForeground(pie.display, gc, 1);
+	XFillArc(pie.display, pie.clip, gc, 0, 0,
+	         pie.fulldiameter, pie.fulldiameter, 0, 360*64);
+	XFreeGC(pie.display, gc);
+	return RETURN_SUCCESS;
+}
+
+/* get resources from the root window; the string got when the display was opened is not updated */
+static char *
+getxrmstring(void)
+{
+	unsigned char *str = NULL;
+	unsigned long len, remain;
+	Atom type;
+	int format;
+
+	if (XGetWindowProperty(pie.display, pie.rootwin, XA_RESOURCE_MANAGER,
+	                       0, LONG_MAX, False, XA_STRING, &type, &format,
+	                       &len, &remain, &str) != Success)
+		return NULL;
+	if (type != XA_STRING || format != 8) {
+		if (str != NULL)
+			XFree(str);
+		return NULL;
+	}
+	return (char *)str;
+}
+
+/* recursivelly drop from menu what changed resources affect; it is redrawn or set up again */
+static void
+untheme(struct Menu *menu, int changed)
+{
+	struct Slice *slice;
+	unsigned n;
+
+	menu->drawn = 0;
+	for (n = 0; n < menu->nslices; n++) {
+		slice = &menu->slices[n];
+		slice->drawn = 0;
+		slice->ttdrawn = 0;
+		if (changed & (THEME_FONT | THEME_GEOMETRY))
+			unsetslice(slice);
+		if (FLAG(changed, THEME_GEOMETRY) && slice->icon != None) {
+			XRenderFreePicture(pie.display, slice->icon);
+			slice->icon = None;
+		}
+		if (slice->submenu != NULL) {
+			untheme(slice->submenu, changed);
+		}
+	}
+	if (FLAG(changed, THEME_GEOMETRY) && menu->win != None) {
+		XRenderFreePicture(pie.display, menu->picture);
+		XFreePixmap(pie.display, menu->pixmap);
+		XDestroyWindow(pie.display, menu->win);
+		menu->picture = None;
+		menu->pixmap = None;
+		menu->win = None;
+	}
+	if ((changed & (THEME_FONT | THEME_GEOMETRY)) && menu->geom.x != NULL) {
+		setmenu(menu);
+	}
+}
+
+/* load resources again, and redraw or set up again the menus they affect */
+static void
+reloadtheme(struct Menu *rootmenu)
+{
+	XRenderColor chans[SCHEME_LAST][COLOR_LAST];
+	CtrlFontSet *fontset = pie.fontset;
+	struct GenCache *entry;
+	int diameter = pie.diameter;
+	int border = pie.border;
+	int changed = 0;
+	char *str;
+	int i, j;
+
+	themechanged = 0;
+	for (i = 0; i < SCHEME_LAST; i++)
+		for (j = 0; j < COLOR_LAST; j++)
+			chans[i][j] = pie.colors[i][j].chans;
+	str = getxrmstring();
+	loadresources(str);
+	if (str != NULL)
+		XFree(str);
+
+	/* find what changed */
+	for (i = 0; i < SCHEME_LAST; i++)
+		for (j = 0; j < COLOR_LAST; j++)
+			if (memcmp(&chans[i][j], &pie.colors[i][j].chans, sizeof(chans[i][j])) != 0)
+				changed |= THEME_COLOR;
+	if (pie.fontset != fontset)
+		changed |= THEME_FONT;
+	if (pie.diameter != diameter || pie.border != border)
+		changed |= THEME_GEOMETRY;
+	if (changed == 0)
+		return;
+
+	if (FLAG(changed, THEME_GEOMETRY)) {
+		XFreePixmap(pie.display, pie.clip);
+		(void)initpie();
+		cleanhitmaps();
+		cleanmasks();
+	} else if (FLAG(changed, THEME_FONT)) {
+		pie.tooltiph = pie.fonth + 2 * TTPAD;
+	}
+	if (changed & (THEME_COLOR | THEME_GEOMETRY))
+		setgradient();
+	if (rootmenu != NULL)
+		untheme(rootmenu, changed);
+	for (i = 0; i < nspecs; i++)
+		untheme(specs[i].menu, changed);
+
+	/* cached menus still in a menu tree have been reached through it */
+	for (entry = gencache; entry != NULL; entry = entry->next)
+		if (entry->menu->parent == NULL)
+			untheme(entry->menu, changed);
+}
+
+/* get latency in microseconds below which given percent of samples fall */
+static long long
+getpercentile(unsigned long *hist, unsigned long nsamples, int percent)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < NBUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum * 100 >= nsamples * percent)
+			break;
+	}
+	return getbucketvalue(i + 1);
+}
+
+static void
+printstats(void)
+{
+	static const char *eventnames[LASTEvent] = {
+		[KeyPress]      = "KeyPress",
+		[ButtonPress]   = "ButtonPress",
+		[ButtonRelease] = "ButtonRelease",
+		[MotionNotify]  = "MotionNotify",
+		[LeaveNotify]   = "LeaveNotify",
+	};
+	static const char *latencynames[LATENCY_LAST] = {
+		[LATENCY_RECEIPT] = "receipt",
+		[LATENCY_SERVER]  = "server",
+	};
+	unsigned long *hist;
+	unsigned long nsamples;
+	char name[32];
+	int type, i, j;
+
+	warnx("events: %lu (motion: %lu, coalesced: %lu, unchanged: %lu)",
+	      stats.nevents, stats.nmotions,
+	      stats.ncoalesced, stats.nunchanged);
+	warnx("repaints: %lu, draws: %lu, flushes: %lu, round trips: %lu",
+	      stats.nrepaints, stats.ndraws, stats.nflushes, stats.nroundtrips);
+	warnx("bytes sent: %llu in %lu interactions (mean: %llu, max: %llu)",
+	      stats.nbytes, stats.ninteractions,
+	      stats.nbytes / MAX(stats.ninteractions, 1), stats.maxbytes);
+	for (type = 0; type < LASTEvent; type++) {
+		for (i = 0; i < LATENCY_LAST; i++) {
+			hist = latency.hist[type][i];
+			nsamples = 0;
+			for (j = 0; j < NBUCKETS; j++)
+				nsamples += hist[j];
+			if (nsamples == 0)
+				continue;
+			if (eventnames[type] != NULL)
+				(void)snprintf(name, sizeof(name), "%s", eventnames[type]);
+			else
+				(void)snprintf(name, sizeof(name), "event %d", type);
+			warnx(
+				"%s latency from %s%s: n=%lu p50<%lldus p95<%lldus p99<%lldus",
+				name,
+				latencynames[i],
+				latency.syncflag ? " (synced)" : "",
+				nsamples,
+				getpercentile(hist, nsamples, 50),
+				getpercentile(hist, nsamples, 95),
+				getpercentile(hist, nsamples, 99)
+			);
+		}
+	}
+}
+
+/* write time taken and round trips made by each startup phase */
+static void
+printprofile(void)
+{
+	static const char *phasenames[PHASE_LAST] = {
+		[PHASE_OTHER]     = "other",
+		[PHASE_XCONN]     = "initxconn",
+		[PHASE_VISUAL]    = "initvisual",
+		[PHASE_RESOURCES] = "initresources",
+		[PHASE_THEME]     = "inittheme",
+		[PHASE_PIE]       = "initpie",
+		[PHASE_IMLIB]     = "imlib2",
+		[PHASE_PARSE]     = "parse",
+		[PHASE_TEXT]      = "setmenu (text)",
+		[PHASE_ICONS]     = "setmenu (icons)",
+		[PHASE_XRES]      = "setmenu (X resources)",
+		[PHASE_IDLE]      = "idle",
+		[PHASE_MAP]       = "map",
+		[PHASE_WAIT]      = "first event",
+		[PHASE_DRAW]      = "first draw",
+	};
+	unsigned long nroundtrips = 0;
+	long long us = 0;
+	int i;
+
+	(void)setphase(profile.phase);
+	for (i = 0; i < PHASE_LAST; i++) {
+		if (profile.us[i] == 0 && profile.nroundtrips[i] == 0)
+			continue;
+		warnx(
+			"startup %s: %lldus, %lu round trips",
+			phasenames[i],
+			profile.us[i],
+			profile.nroundtrips[i]
+		);
+		us += profile.us[i];
+		nroundtrips += profile.nroundtrips[i];
+	}
+	warnx("startup total: %lldus, %lu round trips%s",
+	      us, nroundtrips, profile.running ? " (not finished)" : "");
+}
+
+/* X error handler saving the error code, to check requests that may fail */
+static int
+xerrorsave(Display *dpy, XErrorEvent *e)
+{
+	(void)dpy;
+	xerrorcode = e->error_code;
+	return 0;
+}
+
+/* get modifier mask of the num lock key */
+static unsigned int
+getnumlock(void)
+{
+	XModifierKeymap *modmap;
+	KeyCode keycode;
+	unsigned int mask = 0;
+	int i, j;
+
+	if ((keycode = XKeysymToKeycode(pie.display, XK_Num_Lock)) == 0)
+		return 0;
+	if ((modmap = XGetModifierMapping(pie.display)) == NULL)
+		return 0;
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < modmap->max_keypermod; j++)
+			if (modmap->modifiermap[i * modmap->max_keypermod + j] == keycode)
+				mask = 1 << i;
+	XFreeModifiermap(modmap);
+	return mask;
+}
+
+/* get button presses and the events in mask on the root window, letting the server drop presses not triggering pmenu */
+static void
+grabbuttons(long mask)
+{
+	int (*xerror)(Display *, XErrorEvent *);
+	unsigned int locks[4];
+	int mode;
+	size_t i;
+
+	/* the lock keys are ignored when matching clicks, however they are got */
+	numlockmask = getnumlock();
+
+	/* the pointer is only frozen when the click must be replayed */
+	mode = passclickflag ? GrabModeSync : GrabModeAsync;
+	if (modifier == AnyModifier) {
+		XSelectInput(pie.display, pie.rootwin, mask);
+		XGrabButton(pie.display, button, AnyModifier, pie.rootwin, False, ButtonPressMask, mode, mode, None, None);
+		return;
+	}
+
+	/* select clicks on the root window itself, unless another client does */
+	xerrorcode = Success;
+	xerror = XSetErrorHandler(xerrorsave);
+	XSelectInput(pie.display, pie.rootwin, ButtonPressMask | mask);
+	XSync(pie.display, False);
+	XSetErrorHandler(xerror);
+	if (xerrorcode != Success) {
+		/* grab every click and replay those not triggering pmenu */
+		XSelectInput(pie.display, pie.rootwin, mask);
+		XGrabButton(pie.display, button, AnyModifier, pie.rootwin, False, ButtonPressMask, GrabModeSync, GrabModeSync, None, None);
+		return;
+	}
+
+	/* grab clicks with the modifier, whatever the state of the lock keys */
+	if (modifier == 0)
+		return;
+	locks[0] = 0;
+	locks[1] = LockMask;
+	locks[2] = numlockmask;
+	locks[3] = LockMask | numlockmask;
+	for (i = 0; i < LEN(locks); i++) {
+		XGrabButton(pie.display, button, modifier | locks[i], pie.rootwin, False, ButtonPressMask, mode, mode, None, None);
+	}
+}
+
+/* parse the items read into memory */
+static struct Menu *
+parsespec(char *spec, size_t len)
+{
+	struct Menu *menu;
+	FILE *fp;
+
+	if (len == 0) {
+		warnx("no menu generated");
+		return NULL;
+	}
+	if ((fp = fmemopen(spec, len, "r")) == NULL) {
+		warn("fmemopen");
+		return NULL;
+	}
+	menu = parse(fp, 0);
+	fclose(fp);
+	return menu;
+}
+
+/* parse menu file, noting its state to tell whether it changes */
+static struct Menu *
+readmenu(void)
+{
+	struct Menu *menu;
+	FILE *fp;
+
+	if ((fp = fopen(menufile, "r")) == NULL) {
+		warn("%s", menufile);
+		return NULL;
+	}
+	(void)fstat(fileno(fp), &menustat);
+	menu = parse(fp, 0);
+	fclose(fp);
+	return menu;
+}
+
+/* parse the items and load their icons; run on a thread while the main thread sets up X */
+static void *
+parsemenu(void *arg)
+{
+	struct Menu **menup = arg;
+
+	if (menufile != NULL)
+		*menup = readmenu();
+	else if (stdinspec != NULL) {
+		*menup = parsespec(stdinspec, stdinlen);
+		free(stdinspec);
+		stdinspec = NULL;
+	} else
+		*menup = parse(stdin, 0);
+	if (*menup != NULL)
+		openicons(*menup);
+	return NULL;
+}
+
+/* check whether menu file changed since it was read */
+static int
+menuchanged(void)
+{
+	struct stat st;
+
+	if (stat(menufile, &st) == -1)
+		return 0;
+	return st.st_ino != menustat.st_ino ||
+	       st.st_size != menustat.st_size ||
+	       st.st_mtime != menustat.st_mtime;
+}
+
+/* read menu file again, and merge it into the menu tree */
+static void
+reloadmenu(struct Menu *rootmenu)
+{
+	struct Menu *menu;
+
+	if ((menu = readmenu()) == NULL) {
+		warnx("%s: menu not reloaded", menufile);
+		return;
+	}
+	cleanindex();
+	mergemenu(rootmenu, menu);
+}
+
+#ifdef __linux__
+/* watch menu file for changes; return inotify file descriptor, or -1 if it is checked with a timer */
+static int
+watchmenu(void)
+{
+	char dir[PATH_MAX];
+	const char *s;
+	int fd;
+
+	/* editors often replace the file rather than write it, so its directory is watched */
+	if ((s = strrchr(menufile, '/')) == NULL)
+		(void)snprintf(dir, sizeof(dir), ".");
+	else if (s == menufile)
+		(void)snprintf(dir, sizeof(dir), "/");
+	else
+		(void)snprintf(dir, sizeof(dir), "%.*s", (int)(s - menufile), menufile);
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		warn("inotify_init1");
+	} else if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		warn("%s", dir);
+		close(fd);
+	} else {
+		return fd;
+	}
+	settimer(TIMER_STAT, STATTIME);
+	return -1;
+}
+
+/* read events from inotify file descriptor; return whether the menu file has been written */
+static int
+readwatch(int fd)
+{
+	union {
+		struct inotify_event event;
+		char buf[BUFSIZ];
+	} events;
+	struct inotify_event *event;
+	const char *name;
+	ssize_t len;
+	char *s;
+	int written = 0;
+
+	if ((name = strrchr(menufile, '/')) != NULL)
+		name++;
+	else
+		name = menufile;
+	while ((len = read(fd, events.buf, sizeof(events.buf))) > 0) {
+		for (s = events.buf; s < events.buf + len; s += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)s;
+			if (FLAG(event->mask, IN_Q_OVERFLOW) ||
+			    (event->len > 0 && strcmp(event->name, name) == 0)) {
+				written = 1;
+			}
+		}
+	}
+	return written;
+}
+#else
+/* without inotify, the menu file is checked with a timer */
+static int
+watchmenu(void)
+{
+	settimer(TIMER_STAT, STATTIME);
+	return -1;
 }
 
 static int
-initxconn(void)
+readwatch(int fd)
 {
-	static char *atomnames[NATOMS] = {
-#define X(atom) [atom] = #atom,
-		ATOMS
-#undef X
-	};
+	(void)fd;
+	return 0;
+}
+#endif
 
-	ctrlfnt_init();
-	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-		warnx("could not set locale");
-	if ((pie.display = XOpenDisplay(NULL)) == NULL) {
-		warnx("could not connect to X server");
-		return RETURN_FAILURE;
-	}
-	if (!XInternAtoms(pie.display, atomnames, NATOMS, False, pie.atoms)) {
-		warnx("could not intern X pie.atoms");
-		return RETURN_FAILURE;
+/* pop up menu at origin, or at the pointer if origin is NULL, and run it */
+static void
+popup(struct pollfd *pfd, struct Menu *menu, XPoint *origin)
+{
+	XRectangle monitor;
+	XPoint pointer;
+
+	(void)setphase(PHASE_MAP);
+	if (origin != NULL)
+		pointer = *origin;
+	else
+		getpointer(&pointer);
+	getmonitor(&monitor, &pointer);
+	grabpointer();
+	grabkeyboard();
+	placemenu(menu, &monitor, &pointer);
+	if (!markingflag) {
+		mapmenu(menu, NULL, &monitor);
+		copymenu(menu);
+		warppointer(menu);
 	}
-	pie.screen = XDefaultScreen(pie.display);
-	pie.rootwin = XRootWindow(pie.display, pie.screen);
-	return RETURN_SUCCESS;
+	XFlush(pie.display);
+	(void)setphase(PHASE_WAIT);
+	run(pfd, menu, &monitor, &pointer);
 }
 
+/* check that file is of the given type, owned by the user and not accessible by others */
 static int
-initvisual(void)
+isprivate(const char *path, mode_t type)
 {
-	XVisualInfo vinfo;
-	Colormap cmap;
-	int success;
+	struct stat st;
 
-	success = XMatchVisualInfo(
-		pie.display,
-		pie.screen,
-		32,             /* preferred depth */
-		TrueColor,
-		&vinfo
-	);
-	cmap = success ? XCreateColormap(
-		pie.display,
-		pie.rootwin,
-		vinfo.visual,
-		AllocNone
-	) : None;
-	if (success && cmap != None) {
-		pie.colormap = cmap;
-		pie.visual = vinfo.visual;
-		pie.depth = vinfo.depth;
-	} else {
-		pie.colormap = XDefaultColormap(pie.display, pie.screen);
-		pie.visual = XDefaultVisual(pie.display, pie.screen);
-		pie.depth = XDefaultDepth(pie.display, pie.screen);
+	if (lstat(path, &st) == -1) {
+		/* a missing socket or directory just means that no daemon is running */
+		if (errno != ENOENT)
+			warn("%s", path);
+		return 0;
 	}
-	pie.xformat = XRenderFindVisualFormat(pie.display, pie.visual);
-	if (pie.xformat == NULL)
-		goto error;
-	pie.alphaformat = XRenderFindStandardFormat(pie.display, PictStandardA8);
-	if (pie.alphaformat == NULL)
-		goto error;
-	pie.dummy = createwindow(1, 1, 0);
-	if (pie.dummy == None) {
-		warnx("could not find XRender visual format");
-		return RETURN_FAILURE;
+	if ((st.st_mode & S_IFMT) != type || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+		warnx("%s: not private to the user", path);
+		return 0;
 	}
-	return RETURN_SUCCESS;
-error:
-	warnx("could not find XRender visual format");
-	return RETURN_FAILURE;
+	return 1;
 }
 
+/* check that the process at the other end of the socket is run by the user */
 static int
-initresources(void)
+ispeer(int fd)
 {
-	static struct {
-		const char *class, *name;
-	} resourceids[NRESOURCES] = {
-#define X(res, s1, s2) [res] = { .class = s1, .name = s2, },
-		RESOURCES
-#undef  X
-	};
-	int i;
+#ifdef __linux__
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
 
-	XrmInitialize();
-	pie.application.class = XrmPermStringToQuark(pie.classh.res_class);
-	pie.application.name = XrmPermStringToQuark(pie.classh.res_name);
-	for (i = 0; i < NRESOURCES; i++) {
-		pie.resources[i].class = XrmPermStringToQuark(resourceids[i].class);
-		pie.resources[i].name = XrmPermStringToQuark(resourceids[i].name);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		warn("getsockopt");
+		return 0;
 	}
-	return RETURN_SUCCESS;
+	return cred.uid == getuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) == -1) {
+		warn("getpeereid");
+		return 0;
+	}
+	return uid == getuid();
+#endif
 }
 
+/* get address of the daemon socket, in a directory private to the user; create it if asked to */
 static int
-inittheme(void)
+getsockaddr(struct sockaddr_un *addr, int create)
 {
-	int i, j;
-
-	pie.colors[SCHEME_NORMAL][COLOR_BG].chans = DEF_COLOR_BG;
-	pie.colors[SCHEME_NORMAL][COLOR_FG].chans = DEF_COLOR_FG;
-	pie.colors[SCHEME_SELECT][COLOR_BG].chans = DEF_COLOR_SELBG;
-	pie.colors[SCHEME_SELECT][COLOR_FG].chans = DEF_COLOR_SELFG;
-	pie.colors[SCHEME_BORDER][COLOR_TOP].chans = DEF_COLOR_BORDER;
-	pie.colors[SCHEME_BORDER][COLOR_BOT].chans = DEF_COLOR_BORDER;
-	for (i = 0; i < SCHEME_LAST; i++) {
-		for (j = 0; j < COLOR_LAST; j++) {
-			pie.colors[i][j].pix = XCreatePixmap(
-				pie.display,
-				pie.dummy,
-				1, 1,
-				pie.depth
-			);
-			if (pie.colors[i][j].pix == None) {
-				warnx("could not create pixmap");
-				return RETURN_FAILURE;
-			}
-			pie.colors[i][j].pict = XRenderCreatePicture(
-				pie.display,
-				pie.colors[i][j].pix,
-				pie.xformat,
-				CPRepeat,
-				&(XRenderPictureAttributes){
-					.repeat = RepeatNormal,
-				}
-			);
-			if (pie.colors[i][j].pict == None) {
-				warnx("could not create pixmap");
-				return RETURN_FAILURE;
-			}
-			XRenderFillRectangle(
-				pie.display,
-				PictOpSrc,
-				pie.colors[i][j].pict,
-				&pie.colors[i][j].chans,
-				0, 0, 1, 1
-			);
-		}
+	char dir[PATH_MAX];
+	const char *display, *s;
+	int n;
+
+	if ((s = getenv("XDG_RUNTIME_DIR")) != NULL && *s != '\0')
+		n = snprintf(dir, sizeof(dir), "%s", s);
+	else
+		n = snprintf(dir, sizeof(dir), "/tmp/%s-%ld", NAME, (long)getuid());
+	if (n < 0 || n >= (int)sizeof(dir)) {
+		warnx("path of socket is too long");
+		return RETURN_FAILURE;
 	}
-	loadresources(XResourceManagerString(pie.display));
-	if (pie.fontset == NULL)
-		setfont(NULL, 0.0);
-	if (pie.fontset == NULL) {
-		warnx("could not load any font");
+	if (create && mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		warn("%s", dir);
+		return RETURN_FAILURE;
+	}
+	if (!isprivate(dir, S_IFDIR))
+		return RETURN_FAILURE;
+	if ((display = getenv("DISPLAY")) == NULL)
+		display = "";
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	n = snprintf(
+		addr->sun_path, sizeof(addr->sun_path),
+		"%s/%s%s", dir, NAME, display
+	);
+	if (n < 0 || n >= (int)sizeof(addr->sun_path)) {
+		warnx("path of socket is too long");
 		return RETURN_FAILURE;
 	}
 	return RETURN_SUCCESS;
 }
 
+/* listen on the daemon socket; return its file descriptor */
 static int
-initpie(void)
+listensock(void)
 {
-	GC gc;
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd;
+
+	if (getsockaddr(&addr, 1) == RETURN_FAILURE)
+		exit(1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		errx(1, "%s: daemon already running", addr.sun_path);
+	close(fd);
+
+	/* the socket of a daemon no longer running may be left behind */
+	(void)unlink(addr.sun_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "%s", addr.sun_path);
+	(void)umask(mask);
+	if (listen(fd, SOMAXCONN) == -1)
+		err(1, "listen");
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void)sigaction(SIGPIPE, &(struct sigaction){
+		.sa_handler = SIG_IGN,
+	}, NULL);
+	return fd;
+}
 
-	/* set tooltip geometry */
-	pie.tooltiph = pie.fonth + 2 * TTPAD;
+/* read items sent by client until it stops writing; return NULL on error */
+static char *
+readspec(int fd, size_t *len)
+{
+	char *spec = NULL;
+	size_t size = 0;
+	ssize_t nread;
+
+	*len = 0;
+	for (;;) {
+		if (*len + 1 >= size) {
+			size = (size == 0) ? BUFSIZ : size * 2;
+			spec = erealloc(spec, size);
+		}
+		nread = read(fd, spec + *len, size - *len - 1);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1) {
+			warn("read");
+			free(spec);
+			return NULL;
+		}
+		if (nread == 0)
+			break;
+		*len += nread;
+	}
+	spec[*len] = '\0';
+	return spec;
+}
 
-	/* set the geometry of the triangle for submenus */
-	pie.triangleouter = pie.radius - TRIANGLE_DISTANCE;
-	pie.triangleinner = pie.radius - TRIANGLE_DISTANCE - TRIANGLE_WIDTH;
-	pie.triangleangle = ((double)TRIANGLE_HEIGHT / 2.0) / (double)pie.triangleinner;
+/* get menu built from the items in spec, kept from a previous client or set up anew; spec is consumed */
+static struct Menu *
+specmenu(char *spec, size_t len)
+{
+	struct Menu *menu;
+	int i;
 
-	/* set the separator beginning and end */
-	pie.separatorbeg = pie.radius * SEPARATOR_BEG;
-	pie.separatorend = pie.radius * SEPARATOR_END;
-	pie.innerangle = atan(1.0 / (2.0 * pie.separatorbeg));
-	pie.outerangle = atan(1.0 / (2.0 * pie.separatorend));
+	for (i = 0; i < nspecs; i++)
+		if (strcmp(specs[i].spec, spec) == 0)
+			break;
+	if (i < nspecs) {
+		free(spec);
+		spec = specs[i].spec;
+		menu = specs[i].menu;
+	} else {
+		(void)setphase(PHASE_PARSE);
+		if ((menu = parsespec(spec, len)) == NULL) {
+			free(spec);
+			return NULL;
+		}
+		(void)setphase(PHASE_XRES);
+		setmenu(menu);
+		(void)setphase(PHASE_OTHER);
+
+		/* forget the least recently used menu */
+		if (nspecs == MAXSPECS) {
+			nspecs--;
+			if (search.root == specs[nspecs].menu)
+				cleanindex();
+			cleanmenu(specs[nspecs].menu);
+			free(specs[nspecs].spec);
+		}
+		i = nspecs++;
+	}
 
-	/* create bitmap mask (depth = 1) */
-	pie.clip = XCreatePixmap(
-		pie.display,
-		pie.dummy,
-		pie.fulldiameter,
-		pie.fulldiameter,
-		1
-	);
-	if (pie.clip == None) {
-		warnx("could not create bitmap");
-		return RETURN_FAILURE;
+	/* move the menu to the front */
+	memmove(&specs[1], &specs[0], i * sizeof(*specs));
+	specs[0].spec = spec;
+	specs[0].menu = menu;
+	return menu;
+}
+
+/* show the menu sent by a client, and send back the output of the item entered */
+static void
+serveclient(struct pollfd *pfd, int sockfd)
+{
+	struct timeval tv = {
+		.tv_sec = SPECTIME / 1000,
+		.tv_usec = (SPECTIME % 1000) * 1000,
+	};
+	struct Menu *menu;
+	char *spec;
+	size_t len;
+
+	if ((clientfd = accept(sockfd, NULL, NULL)) == -1) {
+		if (errno != EINTR)
+			warn("accept");
+		return;
+	}
+	(void)fcntl(clientfd, F_SETFD, FD_CLOEXEC);
+	if (!ispeer(clientfd)) {
+		warnx("connection from another user refused");
+		close(clientfd);
+		clientfd = -1;
+		return;
 	}
 
-	/* Create the mask GC */
-	gc = XCreateGC(
-		pie.display,
-		pie.clip,
-		GCBackground | GCArcMode,
-		&(XGCValues){
-			.background = 1,
-			.arc_mode = ArcPieSlice,
-		}
-	);
-	if (gc == NULL) {
-		warnx("could not create graphics context");
-		return RETURN_FAILURE;
+	/* do not let a client that sends nothing hang the daemon */
+	(void)setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if ((spec = readspec(clientfd, &len)) != NULL && (menu = specmenu(spec, len)) != NULL)
+		popup(pfd, menu, NULL);
+	close(clientfd);
+	clientfd = -1;
+}
+
+/* free menus sent by clients */
+static void
+cleanspecs(void)
+{
+	int i;
+
+	for (i = 0; i < nspecs; i++) {
+		cleanmenu(specs[i].menu);
+		free(specs[i].spec);
 	}
+	nspecs = 0;
+}
 
-	/* clear the bitmap */
-	XSetForeground(pie.display, gc, 0);
-	XFillRectangle(pie.display, pie.clip, gc, 0, 0, pie.fulldiameter, pie.fulldiameter);
+/* send items to the daemon and enter the output it sends back; return RETURN_FAILURE if no daemon is running */
+static int
+runclient(void)
+{
+	struct sockaddr_un addr;
+	FILE *fp;
+	char buf[BUFSIZ];
+	char *spec, *s;
+	size_t len;
+	ssize_t nwritten;
+	int fd;
 
-	/* create round shape */
-	XSetForeground(pie.display, gc, 1);
-	XFillArc(pie.display, pie.clip, gc, 0, 0,
-	         pie.fulldiameter, pie.fulldiameter, 0, 360*64);
-	XFreeGC(pie.display, gc);
+	if (getsockaddr(&addr, 0) == RETURN_FAILURE || !isprivate(addr.sun_path, S_IFSOCK))
+		return RETURN_FAILURE;
+
+	/* read all items before connecting, so a slow producer does not stall the daemon */
+	if (menufile == NULL)
+		fd = STDIN_FILENO;
+	else if ((fd = open(menufile, O_RDONLY)) == -1)
+		err(1, "%s", menufile);
+	if ((spec = readspec(fd, &len)) == NULL)
+		exit(1);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		goto error;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		goto error;
+	}
+	if (!ispeer(fd)) {
+		warnx("%s: daemon run by another user", addr.sun_path);
+		close(fd);
+		goto error;
+	}
+	for (s = spec; len > 0; s += nwritten, len -= nwritten) {
+		if ((nwritten = write(fd, s, len)) == -1) {
+			err(1, "write");
+		}
+	}
+	free(spec);
+	(void)shutdown(fd, SHUT_WR);
+	if ((fp = fdopen(fd, "r")) == NULL)
+		err(1, "fdopen");
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		enteritem(buf);
+	}
+	fclose(fp);
 	return RETURN_SUCCESS;
+
+error:
+	/* the standard input cannot be read again; keep it to show the menu ourselves */
+	if (menufile == NULL) {
+		stdinspec = spec;
+		stdinlen = len;
+	} else
+		free(spec);
+	return RETURN_FAILURE;
 }
 
 static void
@@ -2063,6 +5284,9 @@ cleanup(void)
 
 	if (pie.fontset != NULL)
 		ctrlfnt_free(pie.fontset);
+	free(pie.facename);
+	cleanhitmaps();
+	cleanmasks();
 	for (i = 0; i < SCHEME_LAST; i++) {
 		for (j = 0; j < COLOR_LAST; j++) {
 			if (pie.colors[i][j].pict != None) {
@@ -2102,71 +5326,175 @@ main(int argc, char *argv[])
 		inittheme,
 		initpie,
 	};
-	struct pollfd pfd;
+	struct pollfd pfds[3] = { { .fd = -1 }, { .fd = -1 }, { .fd = -1 } };
 	struct Menu *rootmenu = NULL;
-	XRectangle monitor;
-	XPoint pointer;
+	struct Menu *parsed = NULL;             /* set by the parser, read only once it is joined */
+	pthread_t parser;
 	XEvent ev;
 	size_t i;
+	int parsing = 0;
+	int lazy = 1;
+	int nready;
 	int exitval = EXIT_FAILURE;
 
+	/* time startup phases */
+	profile.running = profileflag = (getenv(PROFENV) != NULL);
+	profile.begin = getmicro();
+
 	/* get configuration */
 	getoptions(argc, argv);
 
+	/* let the daemon show the menu, if it is running */
+	if (!rootmodeflag && !daemonflag && runclient() == RETURN_SUCCESS)
+		return EXIT_SUCCESS;
+
+	for (i = 0; i < MAXGENS; i++) {
+		generators[i].pid = -1;
+		generators[i].fd = -1;
+	}
+
+	/* restart reads cut by these signals; poll(2) returns EINTR anyway, so they are noticed */
+	if (statsflag || profileflag) {
+		(void)sigaction(SIGUSR1, &(struct sigaction){
+			.sa_handler = sigusr1,
+			.sa_flags = SA_RESTART,
+		}, NULL);
+	}
+	if (rootmodeflag || daemonflag) {
+		(void)sigaction(SIGHUP, &(struct sigaction){
+			.sa_handler = sighup,
+			.sa_flags = SA_RESTART,
+		}, NULL);
+	}
+
+	/* parse the items while connecting to X; the daemon gets them from clients */
+	if (rootmodeflag || !daemonflag)
+		parsing = (pthread_create(&parser, NULL, parsemenu, &parsed) == 0);
+
 	pie.display = NULL;
-	for (i = 0; i < LEN(initsteps); i++)
+	for (i = 0; i < LEN(initsteps); i++) {
+		(void)setphase(PHASE_XCONN + i);
 		if ((*initsteps[i])() == RETURN_FAILURE)
 			goto error;
+	}
 
-	/* imlib2 stuff */
-	imlib_set_cache_size(2048 * 1024);
-	imlib_context_set_dither(1);
-	imlib_context_set_blend(1);
-	imlib_context_set_display(pie.display);
-	imlib_context_set_visual(pie.visual);
-	imlib_context_set_colormap(pie.colormap);
+	/* wait for the items; Imlib2 must not be used before, as the parser uses it */
+	(void)setphase(PHASE_PARSE);
+	if (parsing) {
+		(void)pthread_join(parser, NULL);
+		parsing = 0;
+	} else if (rootmodeflag || !daemonflag)
+		(void)parsemenu(&parsed);
+	rootmenu = parsed;
+	(void)setphase(PHASE_OTHER);
 
 	/* if running in root mode, get button presses from root window */
+	/* when running continuously, get changes of the resources and of the monitors too */
 	if (rootmodeflag)
-		XGrabButton(pie.display, button, AnyModifier, pie.rootwin, False, ButtonPressMask, GrabModeSync, GrabModeSync, None, None);
-
-	/* generate menus and set them up */
-	rootmenu = parse(stdin, 0);
-	if (rootmenu == NULL)
-		errx(1, "no menu generated");
-	setslices(rootmenu);
+		grabbuttons(PropertyChangeMask | watchmonitors());
+	else if (daemonflag)
+		XSelectInput(pie.display, pie.rootwin, PropertyChangeMask | watchmonitors());
+
+	/* set the root menu up; the submenus are set up in idle time once it is shown */
+	/* the daemon gets the menus from clients */
+	if (rootmodeflag || !daemonflag) {
+		if (rootmenu == NULL)
+			errx(1, "no menu generated");
+
+		/* the pointer may have moved while the items were read; ask for it now */
+		if (!rootmodeflag)
+			askpointer();
+		(void)setphase(PHASE_XRES);
+		setmenu(rootmenu);
+		(void)setphase(PHASE_OTHER);
+	}
 
-	pfd.fd = XConnectionNumber(pie.display);
-	pfd.events = POLLIN;
+	pfds[0].fd = XConnectionNumber(pie.display);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = (rootmodeflag && menufile != NULL) ? watchmenu() : -1;
+	pfds[1].events = POLLIN;
+	pfds[2].fd = daemonflag ? listensock() : -1;
+	pfds[2].events = POLLIN;
 	do {
-		if (rootmodeflag)
+		if (rootmodeflag || daemonflag) {
+			if (themechanged)
+				reloadtheme(rootmenu);
+			(void)setphase(PHASE_IDLE);
+			if ((nready = waitevent(pfds, LEN(pfds), lazy ? 0 : gettimeout())) == -1)
+				err(1, "poll");
+			(void)setphase(PHASE_OTHER);
+			if (nready == 0 && lazy)
+				lazy = setupnext(rootmenu);
+			switch (firetimer()) {
+			case TIMER_CACHE:
+				expirecache();
+				break;
+			case TIMER_STAT:
+				settimer(TIMER_STAT, STATTIME);
+				if (menuchanged())
+					reloadmenu(rootmenu);
+				break;
+			case TIMER_REAP:
+				reapzombies(0);
+				break;
+			default:
+				break;
+			}
+			if (pfds[1].revents != 0 && readwatch(pfds[1].fd))
+				reloadmenu(rootmenu);
+			if (pfds[2].revents != 0)
+				serveclient(&pfds[0], pfds[2].fd);
+			if (pfds[0].revents == 0)
+				continue;
 			XNextEvent(pie.display, &ev);
-		if (!rootmodeflag ||
-		    (ev.type == ButtonPress &&
+			if (ev.type == PropertyNotify) {
+				if (ev.xproperty.atom == XA_RESOURCE_MANAGER)
+					themechanged = 1;
+				continue;
+			}
+			if (changemonitors(&ev))
+				continue;
+		}
+		if ((!rootmodeflag && !daemonflag) ||
+		    (rootmodeflag && ev.type == ButtonPress && ev.xbutton.button == button &&
 		     (modifier == AnyModifier ||
-		      (modifier && ev.xbutton.state == modifier) ||
+		      (modifier && (ev.xbutton.state & ~(LockMask | numlockmask)) == modifier) ||
 		      (ev.xbutton.subwindow == None)))) {
 			if (rootmodeflag && passclickflag) {
 				XAllowEvents(pie.display, ReplayPointer, CurrentTime);
 			}
-			getmonitor(&monitor, &pointer);
-			grabpointer();
-			grabkeyboard();
-			placemenu(rootmenu, &monitor, &pointer);
-			mapmenu(rootmenu, NULL);
-			warppointer(rootmenu);
-			XFlush(pie.display);
-			run(&pfd, rootmenu, &monitor, &pointer);
-		} else {
+			/* in root mode, the pointer is where the button was pressed */
+			if (rootmodeflag)
+				popup(&pfds[0], rootmenu, &(XPoint){ .x = ev.xbutton.x_root, .y = ev.xbutton.y_root });
+			else
+				popup(&pfds[0], rootmenu, NULL);
+		} else if (rootmodeflag) {
 			XAllowEvents(pie.display, ReplayPointer, CurrentTime);
 		}
-	} while (rootmodeflag);
+	} while (rootmodeflag || daemonflag);
 	exitval = EXIT_SUCCESS;
 
 error:
+	if (statsflag)
+		printstats();
+	if (profileflag)
+		printprofile();
+
+	/* if setting X up failed, the parser may still be blocked reading; exiting ends it */
+	if (parsing)
+		exit(exitval);
 	free(iconstring);
+	cleanindex();
 	if (rootmenu != NULL)
 		cleanmenu(rootmenu);
+	cleanspecs();
+	if (pfds[1].fd != -1)
+		close(pfds[1].fd);
+	if (pfds[2].fd != -1)
+		close(pfds[2].fd);
+	cleancache();
+	reapzombies(1);
+	free(monitors.rects);
 	cleanup();
 
 	return exitval;